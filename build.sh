@@ -13,7 +13,7 @@ if [ "${BUILD_TYPE:-debug}" == "release" ]; then
 else
     FLAGS="${FLAGS} -ggdb -O0"
 fi
-cmds="archive env index-add index-init index-info index-push index-squash mount run store sync"
+cmds="archive daemon env index-add index-init index-info index-push index-squash mount run store sync"
 objs=""
 for cmd in ${cmds}; do
     ccache g++ ${FLAGS} -c src/slix-${cmd}.cpp -o build/obj/slix-${cmd}.cpp.o
@@ -23,7 +23,7 @@ ccache g++ ${FLAGS} -c src/slix.cpp -o build/obj/slix.cpp.o
 
 ccache g++ build/obj/slix.cpp.o \
     ${objs} \
-    -lcurl -lfuse3 -lfmt -lcrypto -lyaml-cpp \
+    -lcurl -lfuse3 -lfmt -lcrypto -lyaml-cpp -lzstd \
     -o build/bin/slix
 
 ln -fs slix build/bin/slix-env
@@ -0,0 +1,112 @@
+// SPDX-FileCopyrightText: 2023 S. G. Gottlieb <info.simon@gottliebtfreitag.de>
+// SPDX-License-Identifier: AGPL-3.0-only
+#pragma once
+
+#include "error_fmt.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <fmt/format.h>
+#include <fmt/std.h>
+#include <fstream>
+#include <istream>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Order in which the files of packages are read, see `slix mount --record-profile`
+ *
+ * Stored as text, one access per line: package, entry name (e.g. "rootfs/usr/bin/gcc"),
+ * offset and size, separated by tabs. Accesses are in the order they happened,
+ * consecutive reads of the same file are merged.
+ * Packages may carry the accesses of their own files as meta/prefetch.txt, which
+ * is loaded in the background when they are mounted.
+ */
+struct AccessProfile {
+    struct Access {
+        std::string package;
+        std::string name;
+        uint64_t    offset;
+        uint64_t    size;
+    };
+    std::mutex          mutex;
+    std::vector<Access> accesses;
+
+    AccessProfile() = default;
+    AccessProfile(std::filesystem::path path) {
+        loadFile(path);
+    }
+
+    void record(std::string_view package, std::string_view name, uint64_t offset, uint64_t size) {
+        if (size == 0) return;
+        auto lock = std::lock_guard{mutex};
+        if (!accesses.empty()) {
+            auto& last = accesses.back();
+            if (last.package == package && last.name == name && last.offset + last.size == offset) {
+                last.size += size;
+                return;
+            }
+        }
+        accesses.emplace_back(std::string{package}, std::string{name}, offset, size);
+    }
+
+    void storeFile(std::filesystem::path path) {
+        auto lock = std::lock_guard{mutex};
+        auto ofs = std::ofstream{path, std::ios::binary};
+        if (!ofs) {
+            throw error_fmt{"could not write profile {}", path};
+        }
+        ofs << format(accesses);
+    }
+
+    void loadFile(std::filesystem::path path) {
+        auto ifs = std::ifstream{path, std::ios::binary};
+        if (!ifs) {
+            throw error_fmt{"could not read profile {}", path};
+        }
+        accesses = parse(ifs, path.string());
+    }
+
+    static auto format(std::span<Access const> accesses) -> std::string {
+        auto result = std::string{};
+        for (auto const& a : accesses) {
+            result += fmt::format("{}\t{}\t{}\t{}\n", a.package, a.name, a.offset, a.size);
+        }
+        return result;
+    }
+
+    /** reads the text format, `source` is only used in error messages
+     */
+    static auto parse(std::istream& is, std::string_view source) -> std::vector<Access> {
+        auto result = std::vector<Access>{};
+        auto line   = std::string{};
+        while (std::getline(is, line)) {
+            if (line.empty()) continue;
+            auto fields = std::vector<std::string>{};
+            for (size_t pos{0}, next{0}; next != std::string::npos; pos = next + 1) {
+                next = line.find('\t', pos);
+                fields.emplace_back(line.substr(pos, next - pos));
+            }
+            if (fields.size() != 4) {
+                throw error_fmt{"invalid line in profile {}: {}", source, line};
+            }
+            result.emplace_back(fields[0], fields[1], std::stoull(fields[2]), std::stoull(fields[3]));
+        }
+        return result;
+    }
+
+    /** position of the first access of each file of a package
+     */
+    auto firstAccess(std::string_view package) const -> std::unordered_map<std::string, size_t> {
+        auto result = std::unordered_map<std::string, size_t>{};
+        for (auto const& a : accesses) {
+            if (a.package != package) continue;
+            result.try_emplace(a.name, result.size());
+        }
+        return result;
+    }
+};
@@ -0,0 +1,49 @@
+// SPDX-FileCopyrightText: 2023 S. G. Gottlieb <info.simon@gottliebtfreitag.de>
+// SPDX-License-Identifier: AGPL-3.0-only
+#pragma once
+#define FUSE_USE_VERSION 312
+
+#include <algorithm>
+#include <cstdint>
+#include <fuse3/fuse_common.h>
+
+/**
+ * How long the kernel may cache what a mount reports
+ *
+ * Gar files never change while mounted, so by default entries, attributes,
+ * failed lookups, symlink targets, directory listings and file contents are
+ * kept by the kernel for a long time. If disabled, attributes and entries are
+ * revalidated after a second, like fuse does by default.
+ * A writable mount (see UpperLayer) changes through the kernel, which keeps its
+ * caches up to date, except for failed lookups and directory listings.
+ */
+struct CacheProfile {
+    bool enabled{true};
+    bool writable{false};
+
+    static constexpr double   longTimeout = 24 * 60 * 60; // seconds
+    static constexpr uint32_t maxRequest  = 1024 * 1024;  // bytes per read request
+
+    /** timeout of entries and attributes
+     */
+    auto timeout() const -> double {
+        return enabled ? longTimeout : 1.0;
+    }
+
+    /** timeout of failed lookups, e.g. searching PATH (files might be created later if writable)
+     */
+    auto negativeTimeout() const -> double {
+        return (enabled && !writable) ? longTimeout : 0.0;
+    }
+
+    /** requests the capabilities of this profile during fuse init
+     */
+    void apply(fuse_conn_info* conn) const {
+        if (!enabled) return;
+        if (conn->capable & FUSE_CAP_CACHE_SYMLINKS) {
+            conn->want |= FUSE_CAP_CACHE_SYMLINKS;
+        }
+        // the kernel limits each read request to max_pages, which fuse derives from max_write
+        conn->max_write = std::max(conn->max_write, maxRequest);
+    }
+};
@@ -0,0 +1,193 @@
+// SPDX-FileCopyrightText: 2023 S. G. Gottlieb <info.simon@gottliebtfreitag.de>
+// SPDX-License-Identifier: AGPL-3.0-only
+#pragma once
+
+#include "error_fmt.h"
+#include "fsx/ChunkedFile.h"
+
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <span>
+#include <string>
+#include <sys/file.h>
+#include <unistd.h>
+#include <unordered_set>
+#include <vector>
+#include "sha256.h"
+
+/**
+ * Content addressed storage of file chunks
+ *
+ * Files are split at content defined boundaries (gear hash), so an insertion
+ * or removal only changes the chunks around it. Each chunk is stored once, named
+ * by its sha256 sum, and files are replaced by a manifest (see fsx::ChunkedFile).
+ * Only used for local deduplication so far, chunks are not fetched from a server.
+ */
+struct ChunkStore {
+    std::filesystem::path chunkDir;
+
+    static constexpr size_t   minChunkSize = 16*1024;
+    static constexpr size_t   maxChunkSize = 256*1024;
+    static constexpr uint64_t boundaryMask = (uint64_t{1} << 16) - 1; // ~64KiB average chunk size
+
+    /** random values for each byte, fixed so equal content is always split equally
+     */
+    static constexpr auto gearTable = []() {
+        auto table = std::array<uint64_t, 256>{};
+        auto state = uint64_t{0x736c6978}; // splitmix64
+        for (auto& v : table) {
+            state += 0x9e3779b97f4a7c15;
+            auto z = state;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+            v = z ^ (z >> 31);
+        }
+        return table;
+    }();
+
+    /** length of the first chunk in `data`, `data` must contain the rest of the file or at least maxChunkSize bytes
+     */
+    static auto findBoundary(std::span<char const> data) -> size_t {
+        if (data.size() <= minChunkSize) return data.size();
+        auto end  = std::min(data.size(), maxChunkSize);
+        auto hash = uint64_t{};
+        // the hash only depends on the last 64 bytes, warm it up before the minimum size
+        for (auto i = minChunkSize - 64; i < end; ++i) {
+            hash = (hash << 1) + gearTable[static_cast<uint8_t>(data[i])];
+            if (i >= minChunkSize && (hash & boundaryMask) == 0) {
+                return i+1;
+            }
+        }
+        return end;
+    }
+
+    /** exclusive lock of the store (between processes), see lock()
+     */
+    struct Lock {
+        int fd{-1};
+
+        Lock(std::filesystem::path const& path) {
+            fd = ::open(path.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0600);
+            if (fd == -1) {
+                throw error_fmt{"failed opening {}: {}", path.string(), strerror(errno)};
+            }
+            while (::flock(fd, LOCK_EX) == -1 && errno == EINTR) {}
+        }
+        Lock(Lock const&) = delete;
+        ~Lock() {
+            ::close(fd); // releases the lock
+        }
+    };
+
+    /** held while adding a file and while collecting garbage
+     *
+     * The chunks of a file being added are not referenced by any manifest until
+     * it is written, they must not be collected in the meantime.
+     */
+    auto lock() const -> Lock {
+        std::filesystem::create_directories(chunkDir.parent_path());
+        auto path = chunkDir;
+        path += ".lock";
+        return Lock{path};
+    }
+
+    /** stores a chunk if not already present
+     */
+    auto storeChunk(std::span<char const> data) -> fsx::ChunkRef {
+        auto evp = Evp{};
+        evp.update(data);
+        auto hash = evp.finalize();
+
+        auto ref = fsx::ChunkRef{};
+        std::memcpy(ref.hash.data(), hash.data(), ref.hash.size());
+        ref.size = data.size();
+
+        auto path = fsx::chunkPath(chunkDir, ref.hash);
+        if (exists(path)) return ref;
+
+        std::filesystem::create_directories(path.parent_path());
+        auto tmpPath = path;
+        tmpPath += ".tmp" + std::to_string(getpid());
+        {
+            auto ofs = std::ofstream{tmpPath, std::ios::binary};
+            ofs.write(data.data(), data.size());
+            if (!ofs.good()) {
+                throw error_fmt{"failed writing chunk {}", tmpPath.string()};
+            }
+        }
+        std::filesystem::rename(tmpPath, path);
+        return ref;
+    }
+
+    /** splits `file` into chunks and replaces it by its manifest
+     */
+    void convertToManifest(std::filesystem::path const& file) {
+        auto storeLock = lock();
+        auto ifs = std::ifstream{file, std::ios::binary};
+        if (!ifs.good()) {
+            throw error_fmt{"could not open file {}", file.string()};
+        }
+
+        auto refs   = std::vector<fsx::ChunkRef>{};
+        auto buffer = std::vector<char>(4 * maxChunkSize);
+        auto filled = size_t{};
+        auto eof    = false;
+        while (true) {
+            if (!eof && filled < maxChunkSize) {
+                ifs.read(buffer.data() + filled, buffer.size() - filled);
+                filled += ifs.gcount();
+                eof = !ifs;
+            }
+            if (filled == 0) break;
+            auto len = findBoundary({buffer.data(), filled});
+            refs.push_back(storeChunk({buffer.data(), len}));
+            std::memmove(buffer.data(), buffer.data() + len, filled - len);
+            filled -= len;
+        }
+
+        auto tmpPath = file;
+        tmpPath += ".manifest";
+        {
+            auto ofs    = std::ofstream{tmpPath, std::ios::binary};
+            auto header = fsx::ChunkManifestHeader{};
+            auto count  = uint64_t{refs.size()};
+            ofs.write(reinterpret_cast<char const*>(&header), sizeof(header));
+            ofs.write(reinterpret_cast<char const*>(&count), sizeof(count));
+            ofs.write(reinterpret_cast<char const*>(refs.data()), refs.size() * sizeof(fsx::ChunkRef));
+            if (!ofs.good()) {
+                throw error_fmt{"failed writing manifest {}", tmpPath.string()};
+            }
+        }
+        std::filesystem::rename(tmpPath, file);
+    }
+
+    /** removes all chunks that are not referenced by any manifest inside `manifestDir`
+     */
+    void collectGarbage(std::filesystem::path const& manifestDir) {
+        if (!exists(chunkDir)) return;
+        auto storeLock = lock();
+
+        auto referenced = std::unordered_set<std::string>{};
+        if (exists(manifestDir)) {
+            for (auto const& e : std::filesystem::directory_iterator{manifestDir}) {
+                if (!e.is_regular_file() || !fsx::isChunkManifest(e.path())) continue;
+                auto manifest = fsx::ChunkedFile{e.path()};
+                for (auto const& c : manifest.chunks) {
+                    referenced.insert(fsx::chunkPath(chunkDir, c.hash).filename().string());
+                }
+            }
+        }
+
+        for (auto const& e : std::filesystem::recursive_directory_iterator{chunkDir}) {
+            if (!e.is_regular_file()) continue;
+            if (!referenced.contains(e.path().filename().string())) {
+                std::filesystem::remove(e.path());
+            }
+        }
+    }
+};
@@ -0,0 +1,119 @@
+// SPDX-FileCopyrightText: 2023 S. G. Gottlieb <info.simon@gottliebtfreitag.de>
+// SPDX-License-Identifier: AGPL-3.0-only
+#pragma once
+
+#include "error_fmt.h"
+
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fmt/format.h>
+#include <fmt/ranges.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * Protocol between the slix commands and `slix daemon`
+ *
+ * The daemon listens on a unix socket in the runtime directory of the user.
+ * A request is a single line of tab separated fields, it is answered by a single line:
+ *   mount <mount point> <package>... -> "ok" once mounted, or "error <message>"
+ * Clients attach to the mount like to any other mount, by opening slix-lock.
+ */
+struct DaemonConnection {
+    int fd{-1};
+
+    /** connects to the daemon listening on `socketPath`, check `connected()`
+     */
+    DaemonConnection(std::filesystem::path const& socketPath) {
+        auto addr = sockaddrOf(socketPath);
+        fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1) return;
+        if (::connect(fd, reinterpret_cast<sockaddr const*>(&addr), sizeof(addr)) == -1) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    explicit DaemonConnection(int _fd)
+        : fd{_fd}
+    {}
+    DaemonConnection(DaemonConnection const&) = delete;
+    ~DaemonConnection() {
+        if (fd != -1) ::close(fd);
+    }
+
+    auto connected() const -> bool { return fd != -1; }
+
+    void writeFields(std::vector<std::string> const& fields) {
+        auto line = fmt::format("{}", fmt::join(fields, "\t"));
+        std::ranges::replace(line, '\n', ' '); // e.g. multi line error messages
+        line += '\n';
+        for (size_t pos{0}; pos < line.size();) {
+            auto ct = ::send(fd, line.data() + pos, line.size() - pos, MSG_NOSIGNAL); // no SIGPIPE if the peer is gone
+            if (ct <= 0) {
+                throw error_fmt{"failed talking to slix daemon: {}", strerror(errno)};
+            }
+            pos += ct;
+        }
+    }
+
+    /** reads the next line, no fields if the connection was closed
+     */
+    auto readFields() -> std::vector<std::string> {
+        auto line = std::string{};
+        char c;
+        while (true) {
+            auto ct = ::read(fd, &c, 1);
+            if (ct <= 0) return {};
+            if (c == '\n') break;
+            line += c;
+        }
+        auto fields = std::vector<std::string>{};
+        for (size_t pos{0}, next{0}; next != std::string::npos; pos = next + 1) {
+            next = line.find('\t', pos);
+            fields.emplace_back(line.substr(pos, next - pos));
+        }
+        return fields;
+    }
+
+    static auto sockaddrOf(std::filesystem::path const& socketPath) -> sockaddr_un {
+        auto addr = sockaddr_un{};
+        addr.sun_family = AF_UNIX;
+        if (socketPath.native().size() >= sizeof(addr.sun_path)) {
+            throw error_fmt{"socket path {} is too long", socketPath.string()};
+        }
+        std::strcpy(addr.sun_path, socketPath.c_str());
+        return addr;
+    }
+};
+
+/** asks a running daemon to mount `packages` at `mountPoint`
+ *
+ * \return false if no daemon is running
+ */
+inline auto requestDaemonMount(std::filesystem::path const& socketPath, std::filesystem::path const& mountPoint, std::vector<std::string> const& packages) -> bool {
+    auto connection = DaemonConnection{socketPath};
+    if (!connection.connected()) return false;
+
+    auto request = std::vector<std::string>{"mount", std::filesystem::absolute(mountPoint).string()};
+    for (auto const& p : packages) {
+        // paths to .gar files are resolved by the daemon, which has a different working directory
+        if (p.ends_with(".gar") && std::filesystem::exists(p)) {
+            request.push_back(std::filesystem::absolute(p).string());
+        } else {
+            request.push_back(p);
+        }
+    }
+    connection.writeFields(request);
+    auto reply = connection.readFields();
+    if (reply.empty()) {
+        throw error_fmt{"slix daemon closed the connection"};
+    }
+    if (reply[0] != "ok") {
+        throw error_fmt{"slix daemon failed mounting {}: {}", mountPoint.string(), reply.size() > 1 ? reply[1] : reply[0]};
+    }
+    return true;
+}
@@ -0,0 +1,221 @@
+// SPDX-FileCopyrightText: 2023 S. G. Gottlieb <info.simon@gottliebtfreitag.de>
+// SPDX-License-Identifier: AGPL-3.0-only
+#pragma once
+
+#include "error_fmt.h"
+#include "fsx/File.h"
+
+#include <atomic>
+#include <cstdint>
+#include <fcntl.h>
+#include <filesystem>
+#include <fmt/format.h>
+#include <fmt/ranges.h>
+#include <fstream>
+#include <linux/fs.h>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "sha256.h"
+
+/**
+ * Files extracted by `slix mount --unpack --cache`, shared by all unpacked trees of a store
+ *
+ * Objects are named by the sha256 sum of their content and their permissions, so
+ * equal files of different packages (e.g. other versions) are stored once. For each
+ * package an index maps its entries to objects, unpacking a package a second time
+ * only creates links: reflinks if the file system supports them, hard links otherwise
+ * (changing such a hard linked file in place changes the cache as well).
+ *
+ * Layout: objects/<2 hex digits>/<sha256>-<perms>, index/<package>, tmp/, lock
+ */
+struct ExtractCache {
+    std::filesystem::path dir;
+
+    /** objects of the entries of a single package, by index in its table of contents
+     */
+    struct Index {
+        std::string                             package;
+        std::string                             stamp; // size and modification time of the gar file
+        std::mutex                              mutex;
+        std::unordered_map<size_t, std::string> objects;
+        bool                                    changed{};
+
+        auto find(size_t entry) -> std::string {
+            auto lock = std::lock_guard{mutex};
+            if (auto iter = objects.find(entry); iter != objects.end()) return iter->second;
+            return {};
+        }
+        void set(size_t entry, std::string object) {
+            auto lock = std::lock_guard{mutex};
+            objects[entry] = std::move(object);
+            changed = true;
+        }
+    };
+
+    /** lock of the cache (between processes), see lock()
+     */
+    struct Lock {
+        int fd{-1};
+
+        Lock(std::filesystem::path const& path, int operation) {
+            fd = ::open(path.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0600);
+            if (fd == -1) {
+                throw error_fmt{"failed opening {}: {}", path.string(), strerror(errno)};
+            }
+            while (::flock(fd, operation) == -1 && errno == EINTR) {}
+        }
+        Lock(Lock&& other)
+            : fd{std::exchange(other.fd, -1)}
+        {}
+        Lock(Lock const&) = delete;
+        ~Lock() {
+            if (fd != -1) ::close(fd); // releases the lock
+        }
+    };
+
+    /** held shared while unpacking until its index is stored, exclusive while removing objects
+     *
+     * Objects added by an unpack are not referenced by any index until it is stored,
+     * they must not be removed in the meantime.
+     */
+    auto lock(bool exclusive) const -> Lock {
+        std::filesystem::create_directories(dir);
+        return Lock{dir / "lock", exclusive ? LOCK_EX : LOCK_SH};
+    }
+
+    auto objectPath(std::string const& object) const -> std::filesystem::path {
+        return dir / "objects" / object.substr(0, 2) / object;
+    }
+
+    /** loads the index of a package, it is empty if the gar file changed since it was stored
+     */
+    auto loadIndex(std::string const& package, std::filesystem::path const& garPath) const -> std::unique_ptr<Index> {
+        auto index = std::make_unique<Index>();
+        index->package = package;
+        auto st = stat(garPath);
+        index->stamp = fmt::format("{}\t{}", st.st_size, st.st_mtim.tv_sec);
+
+        auto ifs  = std::ifstream{dir / "index" / package};
+        auto line = std::string{};
+        if (!std::getline(ifs, line) || line != index->stamp) return index;
+        while (std::getline(ifs, line)) {
+            auto tab = line.find('\t');
+            if (tab == std::string::npos) continue;
+            index->objects[std::stoull(line.substr(0, tab))] = line.substr(tab + 1);
+        }
+        return index;
+    }
+
+    void storeIndex(Index const& index) const {
+        auto path    = dir / "index" / index.package;
+        auto tmpPath = path;
+        tmpPath += ".tmp" + std::to_string(getpid());
+        std::filesystem::create_directories(path.parent_path());
+        {
+            auto ofs = std::ofstream{tmpPath};
+            ofs << index.stamp << "\n";
+            for (auto const& [entry, object] : index.objects) {
+                ofs << entry << "\t" << object << "\n";
+            }
+            if (!ofs.good()) {
+                throw error_fmt{"failed writing {}", tmpPath};
+            }
+        }
+        std::filesystem::rename(tmpPath, path);
+    }
+
+    /** unused path to extract a file to, before it is added
+     */
+    auto tempPath() const -> std::filesystem::path {
+        static auto counter = std::atomic<uint64_t>{};
+        auto tmpDir = dir / "tmp";
+        std::filesystem::create_directories(tmpDir);
+        return tmpDir / fmt::format("{}-{}", getpid(), counter++);
+    }
+
+    /** moves an extracted file (with its final permissions) into the cache, returns the object name
+     */
+    auto add(std::filesystem::path const& file) const -> std::string {
+        auto in  = fsx::File{file};
+        auto evp = Evp{};
+        auto buffer = std::vector<char>(1<<20);
+        for (uint64_t pos{0}, ct{0}; (ct = in.read(buffer.data(), buffer.size(), pos)) > 0; pos += ct) {
+            evp.update({buffer.data(), ct});
+        }
+        auto object = fmt::format("{:02x}-{:o}", fmt::join(evp.finalize(), ""), stat(file).st_mode & 07777);
+        auto path   = objectPath(object);
+        std::filesystem::create_directories(path.parent_path());
+        std::filesystem::rename(file, path); // same content if it existed already
+        return object;
+    }
+
+    /** creates `dest` with the content and permissions of an object, without copying if possible
+     */
+    void materialize(std::string const& object, std::filesystem::path const& dest) const {
+        auto path = objectPath(object);
+        std::filesystem::remove(dest);
+        {
+            auto src = fsx::File{path};
+            auto out = fsx::File{};
+            out.fd = ::open(dest.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0600);
+            if (out.fd != -1 && ::ioctl(out.fd, FICLONE, src.fd) == 0) {
+                ::fchmod(out.fd, stat(path).st_mode & 07777);
+                return;
+            }
+        }
+        // no reflinks on this file system, unpacked files share the inode with the cache
+        std::filesystem::remove(dest);
+        auto ec = std::error_code{};
+        std::filesystem::create_hard_link(path, dest, ec);
+        if (ec) { // e.g. on a different file system
+            std::filesystem::copy_file(path, dest);
+        }
+    }
+
+    /** drops the index of a removed package and all objects no index references anymore
+     */
+    void removePackage(std::string const& package) const {
+        auto cacheLock = lock(/*.exclusive=*/true);
+        std::filesystem::remove(dir / "index" / package);
+        if (!exists(dir / "objects")) return;
+
+        auto referenced = std::unordered_set<std::string>{};
+        if (exists(dir / "index")) {
+            for (auto const& e : std::filesystem::directory_iterator{dir / "index"}) {
+                auto ifs  = std::ifstream{e.path()};
+                auto line = std::string{};
+                std::getline(ifs, line); // stamp
+                while (std::getline(ifs, line)) {
+                    if (auto tab = line.find('\t'); tab != std::string::npos) {
+                        referenced.insert(line.substr(tab + 1));
+                    }
+                }
+            }
+        }
+        for (auto const& e : std::filesystem::recursive_directory_iterator{dir / "objects"}) {
+            if (!e.is_regular_file()) continue;
+            if (!referenced.contains(e.path().filename().string())) {
+                std::filesystem::remove(e.path());
+            }
+        }
+    }
+
+private:
+    static auto stat(std::filesystem::path const& path) -> struct stat {
+        struct stat st{};
+        if (::stat(path.c_str(), &st) != 0) {
+            throw error_fmt{"could not stat {}: {}", path, strerror(errno)};
+        }
+        return st;
+    }
+};
@@ -1,27 +1,31 @@
 // SPDX-FileCopyrightText: 2023 S. G. Gottlieb <info.simon@gottliebtfreitag.de>
 // SPDX-License-Identifier: AGPL-3.0-only
 #pragma once
-#define FUSE_USE_VERSION 31
+#define FUSE_USE_VERSION 312
 
+#include "AccessProfile.h"
 #include "fsx/Reader.h"
 
+#include <cstdlib>
 #include <filesystem>
 #include <fmt/format.h>
 #include <fmt/std.h>
 #include <fuse3/fuse.h>
+#include <memory>
+#include <optional>
 #include <ranges>
-#include <unordered_map>
+#include <sstream>
+#include <string_view>
 #include <unordered_set>
 
 /**
  * Represents a single .gar file
  *
- * A gar file is a uncompressed file archive with a specific data structure.
- * This allows it to be easily mounted via fuse.
+ * A gar file is a file archive with a specific data structure.
+ * File contents are either uncompressed or compressed in independent blocks,
+ * this allows it to be easily mounted via fuse.
  */
 struct GarFuse {
-    std::unordered_map<std::string, fsx::Reader::Entry> entries;
-
     fsx::Reader reader;
 
     std::string              name;
@@ -29,8 +33,12 @@ struct GarFuse {
     std::string              description;
     std::vector<std::string> dependencies;
     std::vector<std::string> defaultCmd;
+    std::vector<AccessProfile::Access> prefetchList; // ranges that are read early, see prefetch()
 
     bool verbose;
+    AccessProfile* profile{nullptr}; // records all reads if set
+
+    static constexpr auto rootfs = std::string_view{"rootfs"};
 
     GarFuse(std::filesystem::path pathToPackage, bool _verbose)
         : reader{pathToPackage}
@@ -40,160 +48,249 @@ struct GarFuse {
             fmt::print("opening: {}\n", pathToPackage);
         }
 
-        auto rootfs = std::string{"rootfs"};
-        for (auto entry = reader.readNext(); entry; entry = reader.readNext()) {
-            auto readEntry = [&]() {
-                // extracting the default command
-                auto const& [h, name, offset] = *entry;
-                auto buffer = std::string{};
-                buffer.resize(h.size);
-                auto ct = reader.readContent(buffer.data(), buffer.size(), offset);
-                buffer.resize(ct);
-                return buffer;
-            };
-            if (entry->name == "meta/dependencies.txt") {
-                // special list with dependencies
-                auto buffer = readEntry();
-                for (auto part : std::views::split(buffer, '\n')) {
-                    auto v = std::string_view{&*part.begin(), part.size()};
-                    auto s = std::string(v);
-                    if (s.empty()) continue;
-                    dependencies.push_back(s);
-                }
-                continue;
-            } else if (entry->name == "meta/defaultcmd.txt") {
-                // extracting the default command
-                auto buffer = readEntry();
-                for (auto part : std::views::split(buffer, ' ')) {
-                    auto v = std::string_view{&*part.begin(), part.size()};
-                    auto s = std::string{};
-                    s.reserve(v.size());
-                    for (auto c : v) {
-                        if (c != '\n' && c != '\r') s += c;
-                    }
-                    if (s.empty()) continue;
-                    defaultCmd.push_back(s);
+        auto readEntry = [&](std::string_view entryName) -> std::optional<std::string> {
+            auto entry = reader.toc.find(entryName);
+            if (!entry) return std::nullopt;
+            auto buffer = std::string{};
+            buffer.resize(entry->header.size);
+            auto ct = reader.read(*entry, buffer.data(), buffer.size(), 0);
+            buffer.resize(ct);
+            return buffer;
+        };
+
+        // special list with dependencies
+        if (auto buffer = readEntry("meta/dependencies.txt")) {
+            for (auto part : std::views::split(*buffer, '\n')) {
+                auto v = std::string_view{&*part.begin(), part.size()};
+                auto s = std::string(v);
+                if (s.empty()) continue;
+                dependencies.push_back(s);
+            }
+        }
+        // extracting the default command
+        if (auto buffer = readEntry("meta/defaultcmd.txt")) {
+            for (auto part : std::views::split(*buffer, ' ')) {
+                auto v = std::string_view{&*part.begin(), part.size()};
+                auto s = std::string{};
+                s.reserve(v.size());
+                for (auto c : v) {
+                    if (c != '\n' && c != '\r') s += c;
                 }
-                continue;
-            } else if (entry->name == "meta/name.txt") {
-                // extract name
-                name = readEntry();
-                name.pop_back(); // remove last line break
-                continue;
-            } else if (entry->name == "meta/version.txt") {
-                // extract version
-                version = readEntry();
-                version.pop_back(); // remove last line break
-                continue;
-            } else if (entry->name == "meta/description.txt") {
-                // extract description
-                description = readEntry();
-                description.pop_back(); // remove last line break
-                continue;
-            } else if (entry->name == "meta") {
-                continue;
-            } else if (entry->name.starts_with("meta/")) {
-                fmt::print("unknown meta information file {}\n", entry->name);
-                continue;
+                if (s.empty()) continue;
+                defaultCmd.push_back(s);
             }
+        }
+        // ranges to load when mounted
+        if (auto buffer = readEntry("meta/prefetch.txt")) {
+            auto iss = std::istringstream{*buffer};
+            prefetchList = AccessProfile::parse(iss, "meta/prefetch.txt");
+        }
+        // extract name
+        if (auto buffer = readEntry("meta/name.txt")) {
+            name = *buffer;
+            name.pop_back(); // remove last line break
+        }
+        // extract version
+        if (auto buffer = readEntry("meta/version.txt")) {
+            version = *buffer;
+            version.pop_back(); // remove last line break
+        }
+        // extract description
+        if (auto buffer = readEntry("meta/description.txt")) {
+            description = *buffer;
+            description.pop_back(); // remove last line break
+        }
 
-            auto name = entry->name.substr(rootfs.size());
-            if (name.empty()) name = "/";
-            entries.try_emplace(std::move(name), std::move(*entry));
+        // warn about meta information that is not understood
+        static auto knownMeta = std::unordered_set<std::string_view>{"meta/dependencies.txt", "meta/defaultcmd.txt", "meta/name.txt", "meta/version.txt", "meta/description.txt", "meta/prefetch.txt"};
+        if (auto meta = reader.toc.find("meta"); meta && meta->header.type == 1) {
+            for (auto const& e : reader.toc.children(*meta)) {
+                auto entryName = reader.toc.name(e);
+                if (!knownMeta.contains(entryName)) {
+                    fmt::print("unknown meta information file {}\n", entryName);
+                }
+            }
         }
     }
     GarFuse(GarFuse const&) = delete;
     GarFuse(GarFuse&& oth) noexcept = default;
 
-    auto findEntry(std::string const& v) const -> fsx::Reader::Entry const* {
-        auto iter = entries.find(v);
-        if (iter == entries.end()) return nullptr;
-        return &iter->second;
+    /** finds the entry of a path inside the rootfs, e.g. "/usr/bin"
+     */
+    auto findEntry(std::string_view v) const -> fsx::TocEntry const* {
+        if (v == "/") return reader.toc.find(rootfs);
+        auto pos = v.rfind('/');
+        if (pos == std::string_view::npos) return nullptr;
+        return reader.toc.find(rootfs, v.substr(0, pos), v.substr(pos+1));
+    }
+
+    /** loads all ranges of meta/prefetch.txt into memory, see fsx::Reader::prefetch
+     */
+    void prefetch() {
+        for (auto const& a : prefetchList) {
+            if (auto entry = reader.toc.find(a.name)) {
+                reader.prefetch(*entry, a.offset, a.size);
+            }
+        }
+    }
+
+    /** verify file contents against the Merkle tree of the gar file, see fsx::Reader::enableVerification
+     */
+    void enableVerification(std::optional<fsx::Hash> expectedRoot) {
+        reader.enableVerification(expectedRoot);
+    }
+
+    /** inode number, unique inside this gar file and shared by entries with the same content
+     */
+    auto inode(fsx::TocEntry const& e) const -> ino_t {
+        if (e.linkCount > 1) return (ino_t{1} << 62) | e.fileOffset;
+        return static_cast<ino_t>(reader.toc.index(e)) + 1;
+    }
+
+    /** adds a read to the profile (if recording)
+     */
+    void recordAccess(fsx::TocEntry const& entry, uint64_t offset, uint64_t size) {
+        if (!profile || offset >= entry.header.size) return;
+        profile->record(name, reader.toc.name(entry), offset, std::min(size, entry.header.size - offset));
     }
 
     int getattr_callback(char const* path, struct stat* stbuf) {
         auto entry = findEntry(path);
         //std::cout << "gar - getattr: " << path << " " << (bool)entry << "\n";
         if (!entry) return -ENOENT;
-        auto const& [h, name, offset] = *entry;
+        fillStat(*entry, stbuf);
+        stbuf->st_ino = inode(*entry);
+        return 0;
+    }
 
-        stbuf->st_nlink = 0;
+    /** attributes of an entry, except the inode number
+     */
+    void fillStat(fsx::TocEntry const& entry, struct stat* stbuf) const {
+        auto const& h = entry.header;
+        stbuf->st_nlink = (h.type == 1) ? 0 : entry.linkCount;
         stbuf->st_mode  = [&]() {
             switch(h.type) {
             case 0: return S_IFREG;
             case 1: return S_IFDIR;
             case 2: return S_IFLNK;
+            case 3: return S_IFREG;
             }
             throw std::runtime_error{"unknown type"};
         }() | h.perms;
         stbuf->st_uid  = h.uid;
         stbuf->st_gid  = h.gid;
         stbuf->st_size = h.size;
-        return 0;
     }
 
     int readlink_callback(char const* path, char* targetBuf, size_t size) {
-        auto entry = findEntry(path);
+        return readlink_callback(findEntry(path), targetBuf, size);
+    }
+    int readlink_callback(fsx::TocEntry const* entry, char* targetBuf, size_t size) {
  //       std::cout << "readlink: " << path << " " << (bool)entry << "\n";
         if (!entry) return -ENOENT;
-        auto const& [h, name, offset] = *entry;
+        auto const& h = entry->header;
         if (h.type != 2) return -ENOENT;
 
-        size = std::min(entry->header.size, size-1);
-        auto ct = reader.readContent(targetBuf, size, offset);
+        size = std::min<size_t>(entry->header.size, size-1);
+        try {
+            reader.read(*entry, targetBuf, size, 0);
+        } catch (std::exception const& e) {
+            fmt::print(stderr, "failed reading {}: {}\n", reader.toc.name(*entry), e.what());
+            return -EIO;
+        }
         targetBuf[size] = '\0';
         //std::cout << "read link: " << targetBuf << " " << entry->file_offset << " " << entry->header.size << " " << ct << "\n";
         return 0;
     }
     int open_callback(char const* path, fuse_file_info* fi) {
-        auto entry = findEntry(path);
+        return open_callback(findEntry(path), fi);
+    }
+    int open_callback(fsx::TocEntry const* entry, fuse_file_info* fi) {
 //        std::cout << "open: " << path << " " << (bool)entry << "\n";
         if (!entry) return -ENOENT;
-        auto const& [h, name, offset] = *entry;
-        if (h.type != 0) return -ENOENT;
+        auto const& h = entry->header;
+        if (h.type != 0 && h.type != 3) return -ENOENT;
         return 0;
     }
 
     int read_callback(char const* path, char* buf, size_t size, off_t offset_, fuse_file_info* fi) {
-        auto entry = findEntry(path);
+        return read_callback(findEntry(path), buf, size, offset_, fi);
+    }
+    int read_callback(fsx::TocEntry const* entry, char* buf, size_t size, off_t offset_, fuse_file_info* fi) {
 //        std::cout << "read: " << path << " " << (bool)entry << "\n";
         if (!entry) return -ENOENT;
-        auto const& [h, name, offset] = *entry;
-        if (h.type != 0) return -ENOENT;
+        auto const& h = entry->header;
+        if (h.type != 0 && h.type != 3) return -ENOENT;
 
 //        std::cout << "reading: " << size << "bytes from " << offset_ << " " << offset << "\n";
+        recordAccess(*entry, offset_, size);
+
+        try {
+            return reader.read(*entry, buf, size, offset_);
+        } catch (std::exception const& e) { // e.g. block does not match the Merkle tree
+            fmt::print(stderr, "failed reading {}: {}\n", reader.toc.name(*entry), e.what());
+            return -EIO;
+        }
+    }
+    /** like read_callback, but uncompressed contents are passed as file descriptor range
+     *
+     * This allows libfuse to splice the pages of the gar file into the reply, without
+     * copying them through userspace. `*bufp` is released by libfuse (via free).
+     */
+    int read_buf_callback(fsx::TocEntry const* entry, fuse_bufvec** bufp, size_t size, off_t offset_) {
+        if (!entry) return -ENOENT;
+        auto const& h = entry->header;
+        if (h.type != 0 && h.type != 3) return -ENOENT;
 
-        auto ct = reader.readContent(buf, size, offset + offset_);
-        return ct;
+        recordAccess(*entry, offset_, size);
+        auto vec = static_cast<fuse_bufvec*>(std::malloc(sizeof(fuse_bufvec)));
+        if (!vec) return -ENOMEM;
+        *vec = FUSE_BUFVEC_INIT(size);
+        auto& buf = vec->buf[0];
+        try {
+            if (auto range = reader.fileRange(*entry, size, offset_)) {
+                buf.size  = range->size;
+                buf.flags = static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+                buf.fd    = range->fd;
+                buf.pos   = range->offset;
+            } else {
+                buf.mem = std::malloc(std::max<size_t>(size, 1));
+                if (!buf.mem) throw std::bad_alloc{};
+                buf.size = reader.read(*entry, static_cast<char*>(buf.mem), size, offset_);
+            }
+        } catch (std::exception const& e) {
+            fmt::print(stderr, "failed reading {}: {}\n", reader.toc.name(*entry), e.what());
+            std::free(buf.mem);
+            std::free(vec);
+            return -EIO;
+        }
+        *bufp = vec;
+        return 0;
     }
-    int readdir_callback(char const* path, void* buf, fuse_fill_dir_t filler, std::unordered_set<std::string>& satisfiedFiles) {
+
+    /** children of a directory, can be continued at any index via `offset`
+     *
+     * \param cb: called with the name of each child and the offset of the next child,
+     *            returning true stops the listing (e.g. buffer is full)
+     */
+    template <typename CB>
+    int readdir_callback(char const* path, size_t offset, CB const& cb) {
         auto entry = findEntry(path);
         //std::cout << "readdir: " << path << " " << (bool)entry << "\n";
         if (!entry) return -ENOENT;
-        auto const& [h, name, offset] = *entry;
+        auto const& h = entry->header;
         if (h.type != 1) return -ENOENT;
 
-        auto fpath = std::string_view{path};
-
-        std::string_view fpath2 = fpath;
-        for (auto const& s : entries) {
-            if (s.first.starts_with(fpath) && s.first.size() > fpath.size() + 1) {
-                if (s.first[fpath.size()] != '/' and fpath.size() > 1) continue;
-                auto pos = s.first.find('/', fpath.size()+1);
-//                std::cout << " - skip: " << s.first << " found at " << s.first.substr(s.first.find('/', fpath.size()+1)) << "\n";
-                if (pos != std::string_view::npos) continue;
-                auto child_name = std::filesystem::path{s.first}.lexically_proximate(fpath).string();
-                if (!satisfiedFiles.contains(child_name)) {
-                    satisfiedFiles.emplace(child_name);
-                    //std::cout << " - child: " << child_name << "\n";
-                    filler(buf, child_name.c_str(), nullptr, 0, {});
-                }
-            }
+        auto children = reader.toc.children(*entry);
+        for (auto i = offset; i < children.size(); ++i) {
+            if (cb(reader.toc.baseName(children[i]), i+1)) break;
         }
         return 0;
     }
 };
 
-
-
-
+/** gar files of a mount, earlier layers shadow later ones
+ *
+ * Layers are shared, so mounts of the same package (see slix daemon) use the same GarFuse.
+ */
+using Layers = std::vector<std::shared_ptr<GarFuse>>;
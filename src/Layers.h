@@ -0,0 +1,335 @@
+// SPDX-FileCopyrightText: 2023 S. G. Gottlieb <info.simon@gottliebtfreitag.de>
+// SPDX-License-Identifier: AGPL-3.0-only
+#pragma once
+
+#include "GarFuse.h"
+#include "PackageIndex.h"
+#include "slix.h"
+#include "utils.h"
+#include "Stores.h"
+#include "error_fmt.h"
+#include "sha256.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <fcntl.h>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <thread>
+#include <tuple>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/** name and path of each package of a mount, in order of precedence
+ */
+using PackageList = std::vector<std::tuple<std::string, std::filesystem::path>>;
+
+/** finds the requested packages (names or paths to .gar files) and all their dependencies
+ *
+ * The order is deterministic: requested packages in the given order, each followed
+ * by its dependencies.
+ */
+inline auto resolvePackages(Stores& stores, std::vector<std::string> const& requested, bool verbose) -> PackageList {
+    auto requiredPackages = PackageList{};
+    auto knownPackages    = std::unordered_set<std::string>{};
+    auto addPackage = [&](std::string const& name, std::filesystem::path const& path) {
+        if (knownPackages.insert(name).second) {
+            requiredPackages.emplace_back(name, path);
+        }
+    };
+
+    for (auto requested_name : requested) {
+        auto [store, name] = stores.findNewestPackageByName(requested_name, /*installed = */ true);
+        if (name.empty()) {
+            throw error_fmt{"package {} not found", requested_name};
+        }
+        auto [knownList, installedStore] = stores.findExactPattern(name);
+        if (!installedStore) {
+            // load Gar from file
+            if (exists(std::filesystem::path(name)) && name.ends_with(".gar")) {
+                auto package_name = std::filesystem::path{name}.stem().string();
+                if (knownPackages.contains(package_name)) {
+                    continue;
+                }
+                addPackage(package_name, name);
+                auto gar = GarFuse{std::filesystem::path{name}, verbose};
+                for (auto d : gar.dependencies) {
+                    if (knownPackages.contains(d)) {
+                        continue;
+                    }
+                    auto [knownList, installedStore] = stores.findExactPattern(d);
+                    if (!installedStore) {
+                        throw error_fmt{"package {} not installed, required for {}", d, name};
+                    }
+                    addPackage(d, installedStore->getPackagePath(d));
+                }
+            } else {
+                throw error_fmt{"package {}({}) not installed", requested_name, name};
+            }
+        } else {
+            // Loading Gar from store
+            if (knownPackages.contains(name)) {
+                continue;
+            }
+            addPackage(name, installedStore->getPackagePath(name));
+            auto dependencies = installedStore->loadPackageIndex().findDependencies(name);
+            auto sortedDependencies = std::set<std::string>(dependencies.begin(), dependencies.end());
+            for (auto const& d : sortedDependencies) {
+                addPackage(d, installedStore->getPackagePath(d));
+            }
+        }
+    }
+    return requiredPackages;
+}
+
+/** Merkle root of a package as recorded in the index of the store it is installed from
+ *
+ * nullopt if the index does not record one (e.g. the index is stale).
+ */
+inline auto expectedMerkleRoot(Stores& stores, std::string const& name) -> std::optional<fsx::Hash> {
+    auto [knownList, installedStore] = stores.findExactPattern(name);
+    if (!installedStore) return std::nullopt;
+    auto index = installedStore->loadPackageIndex();
+    auto info  = static_cast<PackageIndex::Info const*>(nullptr);
+    try {
+        info = std::get<1>(index.findPackageInfo(name));
+    } catch (std::exception const&) {
+        return std::nullopt; // not listed in the index
+    }
+    if (!info || info->merkle.empty()) return std::nullopt;
+    return fsx::fromHex(info->merkle);
+}
+
+/** shared mount point of the given packages in the runtime directory
+ *
+ * Named after a hash of the resolved packages (in order of precedence, which
+ * decides what is visible). Commands requesting the same environment end up at
+ * the same path and attach to a live mount through its slix-lock instead of
+ * mounting again.
+ */
+inline auto sharedMountPoint(PackageList const& packages) -> std::filesystem::path {
+    auto evp = Evp{};
+    for (auto const& [name, path] : packages) {
+        auto line = fmt::format("{}\t{}\n", name, std::filesystem::absolute(path).string());
+        evp.update(line);
+    }
+    auto key = fmt::format("{:02x}", fmt::join(evp.finalize(), "")).substr(0, 32);
+    auto mounts = getSlixRuntimePath() / "mounts"; // only accessible by this user
+    if (::mkdir(mounts.c_str(), 0700) != 0 && errno != EEXIST) {
+        throw error_fmt{"failed creating {}: {}", mounts, strerror(errno)};
+    }
+    struct stat st;
+    if (::lstat(mounts.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid()) {
+        throw error_fmt{"refusing to use {}, it must be a directory owned by uid {}", mounts, getuid()};
+    }
+    return mounts / key;
+}
+
+/** true if `mountPoint` was returned by sharedMountPoint
+ */
+inline auto isSharedMountPoint(std::filesystem::path const& mountPoint) -> bool {
+    auto parent = std::filesystem::absolute(mountPoint).parent_path();
+    return parent.filename() == "mounts" && parent.parent_path() == getSlixRuntimePath();
+}
+
+/**
+ * Exclusive lock of a shared mount point, held while checking whether it is served and mounting it
+ *
+ * Concurrent commands activating the same environment wait for each other, so only
+ * one of them mounts. A process forked while locked shares the lock, `unlock` releases
+ * it for both.
+ */
+struct MountPointLock {
+    int fd{-1};
+
+    explicit MountPointLock(std::filesystem::path const& mountPoint) {
+        auto path = mountPoint;
+        path += ".lock";
+        fd = ::open(path.c_str(), O_CREAT | O_RDWR | O_CLOEXEC | O_NOFOLLOW, 0600);
+        if (fd == -1) {
+            throw error_fmt{"failed opening {}: {}", path, strerror(errno)};
+        }
+        while (::flock(fd, LOCK_EX) == -1 && errno == EINTR) {}
+    }
+    MountPointLock(MountPointLock const&) = delete;
+    ~MountPointLock() {
+        unlock();
+    }
+
+    void unlock() {
+        if (fd == -1) return;
+        ::flock(fd, LOCK_UN);
+        ::close(fd);
+        fd = -1;
+    }
+};
+
+/**
+ * Closes a mount once its last client is gone
+ *
+ * `idle` is called on a fuse worker thread when the last client released slix-lock,
+ * it only wakes a single long lived thread. That thread waits a grace period, so a
+ * process can reattach (e.g. after exec), and closes the mount if still no client is
+ * attached. For shared mount points the check and the close happen while holding the
+ * MountPointLock, commands attaching hold it while probing and opening slix-lock.
+ * `exit` closes right away, it only writes to a pipe and may be called from a signal handler.
+ */
+struct IdleCloser {
+    int          fds[2]{-1, -1}; // wakes the thread: 'i' idle, 'x' exit, 'q' quit without closing
+    std::jthread thread;
+
+    template <typename FuseFS>
+    explicit IdleCloser(FuseFS& fuseFS) {
+        if (::pipe2(fds, O_CLOEXEC) == -1) {
+            throw error_fmt{"failed creating pipe: {}", strerror(errno)};
+        }
+        auto shared = isSharedMountPoint(fuseFS.mountPoint);
+        thread = std::jthread{[this, &fuseFS, shared]() {
+            while (true) {
+                char c{};
+                auto ct = ::read(fds[0], &c, 1);
+                if (ct == -1 && errno == EINTR) continue;
+                if (ct != 1 || c == 'q') return;
+                auto lock = std::optional<MountPointLock>{};
+                if (c == 'i') {
+                    std::this_thread::sleep_for(std::chrono::milliseconds{100});
+                    if (shared) {
+                        try {
+                            lock.emplace(fuseFS.mountPoint);
+                        } catch (std::exception const&) {} // lock file is gone, close anyway
+                    }
+                    if (fuseFS.connectedClients > 0) continue;
+                }
+                fuseFS.close();
+                return;
+            }
+        }};
+    }
+    IdleCloser(IdleCloser const&) = delete;
+    ~IdleCloser() {
+        send('q');
+        thread.join();
+        ::close(fds[0]);
+        ::close(fds[1]);
+    }
+
+    void idle() { send('i'); }
+    void exit() { send('x'); }
+
+private:
+    void send(char c) {
+        while (::write(fds[1], &c, 1) == -1 && errno == EINTR) {}
+    }
+};
+
+/**
+ * Opened gar files by path, shared by all mounts using them
+ *
+ * A gar file is closed when the last mount using it is gone.
+ */
+struct LayerCache {
+    std::mutex                                              mutex;
+    std::unordered_map<std::string, std::weak_ptr<GarFuse>> layers;
+
+    /** returns the opened gar file of `path`, or opens it with `open`
+     */
+    template <typename CB>
+    auto get(std::filesystem::path const& path, CB const& open) -> std::shared_ptr<GarFuse> {
+        {
+            auto lock = std::lock_guard{mutex};
+            std::erase_if(layers, [](auto const& e) { return e.second.expired(); });
+            if (auto iter = layers.find(path.string()); iter != layers.end()) {
+                if (auto layer = iter->second.lock()) return layer;
+            }
+        }
+        auto layer = open();
+        auto lock  = std::lock_guard{mutex};
+        auto& entry = layers[path.string()];
+        if (auto other = entry.lock()) return other; // opened by someone else in the meantime
+        entry = layer;
+        return layer;
+    }
+};
+
+/** opens all packages in parallel, layers are in the same order as `packages`
+ *
+ * \param cache: if given, already opened gar files are reused
+ */
+inline auto openLayers(Stores& stores, PackageList const& packages, size_t threads, bool verify, bool verbose, LayerCache* cache = nullptr) -> Layers {
+    auto expectedRoots = std::vector<std::optional<fsx::Hash>>(packages.size());
+    if (verify) {
+        for (size_t i{0}; i < packages.size(); ++i) {
+            expectedRoots[i] = expectedMerkleRoot(stores, std::get<0>(packages[i]));
+        }
+    }
+    auto open = [&](size_t i) {
+        auto const& [name, path] = packages[i];
+        auto layer = std::make_shared<GarFuse>(path, verbose);
+        if (verify && !layer->reader.merkleRoot()) {
+            fmt::print(stderr, "package {} has no Merkle tree, its contents are not verified\n", name);
+        } else if (verify) {
+            try {
+                layer->enableVerification(expectedRoots[i]);
+            } catch (std::exception const& e) {
+                throw error_fmt{"failed verifying package {}: {}", name, e.what()};
+            }
+        }
+        return layer;
+    };
+
+    auto layers = Layers(packages.size());
+    auto errors = std::vector<std::exception_ptr>(packages.size());
+    auto next   = std::atomic<size_t>{0};
+    {
+        auto workers = std::vector<std::jthread>{};
+        for (size_t t{0}; t < std::min(std::max<size_t>(threads, 1), packages.size()); ++t) {
+            workers.emplace_back([&]() {
+                for (auto i = next++; i < packages.size(); i = next++) {
+                    try {
+                        layers[i] = cache ? cache->get(std::get<1>(packages[i]), [&]() { return open(i); }) : open(i);
+                    } catch (...) {
+                        errors[i] = std::current_exception();
+                    }
+                }
+            });
+        }
+    }
+    for (auto const& e : errors) {
+        if (e) {
+            std::rethrow_exception(e);
+        }
+    }
+    return layers;
+}
+
+/** loads the prefetch lists of all layers, layers are distributed over `threads` threads
+ */
+inline void prefetch(Layers const& layers, size_t threads, bool verbose) {
+    auto next    = std::atomic<size_t>{0};
+    auto workers = std::vector<std::jthread>{};
+    for (size_t t{0}; t < std::min(std::max<size_t>(threads, 1), layers.size()); ++t) {
+        workers.emplace_back([&]() {
+            for (auto i = next++; i < layers.size(); i = next++) {
+                try {
+                    layers[i]->prefetch();
+                } catch (std::exception const& e) { // only an optimization, the error shows up again when reading
+                    if (verbose) {
+                        fmt::print(stderr, "prefetching {} failed: {}\n", layers[i]->name, e.what());
+                    }
+                }
+            }
+        });
+    }
+}
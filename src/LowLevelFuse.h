@@ -0,0 +1,460 @@
+// SPDX-FileCopyrightText: 2023 S. G. Gottlieb <info.simon@gottliebtfreitag.de>
+// SPDX-License-Identifier: AGPL-3.0-only
+#pragma once
+#define FUSE_USE_VERSION 312
+
+#include "CacheProfile.h"
+#include "GarFuse.h"
+
+#include <atomic>
+#include <filesystem>
+#include <functional>
+#include <fuse3/fuse_lowlevel.h>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Mounts multiple gar files as one union file system, using the fuse low level api
+ *
+ * Instead of full paths, the kernel passes inode numbers. Each entry gets a stable
+ * inode number derived from its layer and its index in the table of contents,
+ * so every request is answered without any path lookup. `lookup` only has to
+ * resolve a single name inside a directory.
+ * Like MyFuse, earlier layers hide entries of later layers with the same path.
+ * If the kernel supports fuse passthrough (linux 6.9+, libfuse 3.16+), reads of aligned
+ * uncompressed files are served by the kernel directly, see openBacking.
+ */
+struct LowLevelFuse {
+    fuse_session* session{nullptr};
+    std::filesystem::path mountPoint;
+
+    Layers nodes;
+    std::atomic<size_t> connectedClients{};
+    std::function<void()> onIdle; // called on a fuse worker thread when the last client released slix-lock
+    bool verbose;
+    CacheProfile cache;
+    std::atomic<bool> passthrough{}; // kernel reads files directly from backing files, see openBacking
+
+    // backing file registered with the kernel (id 0: served by read) and number of opens, by inode
+    struct Backing {
+        int    id{};
+        size_t opens{};
+    };
+    std::mutex backingMutex;
+    std::unordered_map<fuse_ino_t, Backing> backings;
+
+    static constexpr fuse_ino_t lockIno = 2; // slix-lock in the root directory
+
+    // same directory in each layer (nullptr if missing), by directory inode
+    std::mutex dirsMutex;
+    std::unordered_map<fuse_ino_t, std::vector<fsx::TocEntry const*>> dirs;
+
+    LowLevelFuse(Layers nodes_, bool _verbose, std::filesystem::path _mountPoint, std::vector<std::string> options, CacheProfile _cache = {})
+        : mountPoint{_mountPoint}
+        , nodes{std::move(nodes_)}
+        , verbose{_verbose}
+        , cache{_cache} {
+        if (verbose) {
+            std::cout << "creating mount point at " << mountPoint << "\n";
+        }
+        fuse_args args = FUSE_ARGS_INIT(0, nullptr);
+        fuse_opt_add_arg(&args, "");
+
+        for (auto const& s : options) {
+            fuse_opt_add_arg(&args, s.c_str());
+            if (_verbose) {
+                fmt::print("add mount option: {}\n", s);
+            }
+        }
+        if (_verbose) {
+            fuse_lowlevel_help();
+        }
+        auto operations = fuse_lowlevel_ops {
+            .init     = [](void* userdata, fuse_conn_info* conn) {
+                auto& self = *reinterpret_cast<LowLevelFuse*>(userdata);
+                self.cache.apply(conn);
+                if (conn->capable & FUSE_CAP_SPLICE_WRITE) { // replies of read are spliced from the gar files
+                    conn->want |= FUSE_CAP_SPLICE_WRITE | (conn->capable & FUSE_CAP_SPLICE_MOVE);
+                }
+#if FUSE_MINOR_VERSION >= 16
+                if (conn->capable & FUSE_CAP_PASSTHROUGH) {
+                    conn->want |= FUSE_CAP_PASSTHROUGH;
+                    self.passthrough = true;
+                }
+#endif
+            },
+            .lookup   = [](fuse_req_t req, fuse_ino_t parent, char const* name) {
+                handle(req, [&](auto& self) { self.lookup(req, parent, name); });
+            },
+            .getattr  = [](fuse_req_t req, fuse_ino_t ino, fuse_file_info*) {
+                handle(req, [&](auto& self) { self.getattr(req, ino); });
+            },
+            .readlink = [](fuse_req_t req, fuse_ino_t ino) {
+                handle(req, [&](auto& self) { self.readlink(req, ino); });
+            },
+            .open     = [](fuse_req_t req, fuse_ino_t ino, fuse_file_info* fi) {
+                handle(req, [&](auto& self) { self.open(req, ino, fi); });
+            },
+            .read     = [](fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, fuse_file_info*) {
+                handle(req, [&](auto& self) { self.read(req, ino, size, offset); });
+            },
+            .release  = [](fuse_req_t req, fuse_ino_t ino, fuse_file_info*) {
+                handle(req, [&](auto& self) { self.release(req, ino); });
+            },
+            .opendir  = [](fuse_req_t req, fuse_ino_t ino, fuse_file_info* fi) {
+                handle(req, [&](auto& self) { self.opendir(req, ino, fi); });
+            },
+            .readdir  = [](fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, fuse_file_info*) {
+                handle(req, [&](auto& self) { self.readdir(req, ino, size, offset); });
+            },
+        };
+        session = fuse_session_new(&args, &operations, sizeof(operations), this);
+        if (!session) {
+            throw std::runtime_error{"failed creating fuse session"};
+        }
+        int r = fuse_session_mount(session, mountPoint.c_str());
+        if (r != 0) {
+            throw std::runtime_error{"failed mounting"};
+        }
+    }
+    LowLevelFuse(LowLevelFuse const&) = delete;
+
+    ~LowLevelFuse() {
+        fuse_session_destroy(session);
+        if (!mountPoint.empty()) {
+            remove(mountPoint);
+        }
+    }
+
+    void close() {
+        fuse_session_exit(session);
+        fuse_session_unmount(session);
+    }
+
+    /** serves requests until unmounted, with `threads` > 1 requests are handled concurrently
+     */
+    void loop(size_t threads = 1) {
+        if (threads <= 1) {
+            fuse_session_loop(session);
+            return;
+        }
+#if FUSE_MINOR_VERSION >= 12
+        auto config = fuse_loop_cfg_create();
+        fuse_loop_cfg_set_max_threads(config, threads);
+        fuse_loop_cfg_set_idle_threads(config, threads);
+        fuse_loop_cfg_set_clone_fd(config, 1); // one /dev/fuse file descriptor per thread
+        fuse_session_loop_mt(session, config);
+        fuse_loop_cfg_destroy(config);
+#else // no limit of the number of threads before libfuse 3.12
+        auto config = fuse_loop_config{.clone_fd = 1, .max_idle_threads = static_cast<unsigned int>(threads)};
+        fuse_session_loop_mt(session, &config);
+#endif
+    }
+
+    /** calls `cb` with the file system of the request, errors are replied as EIO
+     */
+    template <typename CB>
+    static void handle(fuse_req_t req, CB const& cb) {
+        auto& self = *reinterpret_cast<LowLevelFuse*>(fuse_req_userdata(req));
+        try {
+            cb(self);
+        } catch (std::exception const& e) {
+            fmt::print(stderr, "failed handling fuse request: {}\n", e.what());
+            fuse_reply_err(req, EIO);
+        }
+    }
+
+    static auto toIno(size_t layer, size_t index) -> fuse_ino_t {
+        return (static_cast<fuse_ino_t>(layer + 1) << 32) | index;
+    }
+
+    /** layer and entry of an inode, the root inode is the root of the first layer
+     */
+    auto fromIno(fuse_ino_t ino) const -> std::tuple<size_t, fsx::TocEntry const*> {
+        if (ino == FUSE_ROOT_ID) {
+            for (size_t layer{0}; layer < nodes.size(); ++layer) {
+                if (auto entry = nodes[layer]->findEntry("/")) return {layer, entry};
+            }
+            return {0, nullptr};
+        }
+        auto layer = static_cast<size_t>(ino >> 32) - 1;
+        auto index = static_cast<size_t>(ino & 0xffff'ffff);
+        if ((ino >> 32) == 0 || layer >= nodes.size() || index >= nodes[layer]->reader.toc.entries.size()) {
+            return {0, nullptr};
+        }
+        return {layer, &nodes[layer]->reader.toc.entries[index]};
+    }
+
+    /** the directory `ino` in every layer, empty if it is not a directory
+     */
+    auto unionDir(fuse_ino_t ino) -> std::vector<fsx::TocEntry const*> const& {
+        auto lock = std::lock_guard{dirsMutex};
+        if (auto iter = dirs.find(ino); iter != dirs.end()) return iter->second;
+
+        auto& result = dirs[ino];
+        auto [layer, entry] = fromIno(ino);
+        if (!entry || entry->header.type != 1) return result;
+        auto name = nodes[layer]->reader.toc.name(*entry);
+        result.resize(nodes.size());
+        for (size_t i{0}; i < nodes.size(); ++i) {
+            auto e = (i == layer) ? entry : nodes[i]->reader.toc.find(name);
+            if (e && e->header.type == 1) {
+                result[i] = e;
+            }
+        }
+        return result;
+    }
+
+    auto entryParam(size_t layer, fsx::TocEntry const& entry) const -> fuse_entry_param {
+        auto param = fuse_entry_param{};
+        param.ino = toIno(layer, nodes[layer]->reader.toc.index(entry));
+        nodes[layer]->fillStat(entry, &param.attr);
+        param.attr.st_ino  = param.ino;
+        param.attr_timeout  = cache.timeout();
+        param.entry_timeout = cache.timeout();
+        return param;
+    }
+
+    static auto lockStat() -> struct stat {
+        struct stat st{};
+        st.st_ino   = lockIno;
+        st.st_nlink = 0;
+        st.st_mode  = S_IFREG;
+        st.st_size  = 0;
+        return st;
+    }
+
+    void lookup(fuse_req_t req, fuse_ino_t parent, char const* name) {
+        if (parent == FUSE_ROOT_ID && name == std::string_view{"slix-lock"}) {
+            auto param = fuse_entry_param{};
+            param.ino  = lockIno;
+            param.attr = lockStat();
+            param.attr_timeout  = cache.timeout();
+            param.entry_timeout = cache.timeout();
+            fuse_reply_entry(req, &param);
+            return;
+        }
+        auto const& layers = unionDir(parent);
+        for (size_t layer{0}; layer < layers.size(); ++layer) {
+            if (!layers[layer]) continue;
+            if (auto child = nodes[layer]->reader.toc.findChild(*layers[layer], name)) {
+                auto param = entryParam(layer, *child);
+                fuse_reply_entry(req, &param);
+                return;
+            }
+        }
+        if (cache.negativeTimeout() > 0) { // inode 0 lets the kernel remember that the entry does not exist
+            auto param = fuse_entry_param{};
+            param.entry_timeout = cache.negativeTimeout();
+            fuse_reply_entry(req, &param);
+            return;
+        }
+        fuse_reply_err(req, ENOENT);
+    }
+
+    void getattr(fuse_req_t req, fuse_ino_t ino) {
+        if (ino == lockIno) {
+            auto st = lockStat();
+            fuse_reply_attr(req, &st, cache.timeout());
+            return;
+        }
+        auto [layer, entry] = fromIno(ino);
+        if (!entry) {
+            fuse_reply_err(req, ENOENT);
+            return;
+        }
+        struct stat st{};
+        nodes[layer]->fillStat(*entry, &st);
+        st.st_ino = ino;
+        fuse_reply_attr(req, &st, cache.timeout());
+    }
+
+    void readlink(fuse_req_t req, fuse_ino_t ino) {
+        auto [layer, entry] = fromIno(ino);
+        if (!entry || entry->header.type != 2) {
+            fuse_reply_err(req, EINVAL);
+            return;
+        }
+        auto target = std::string(entry->header.size, '\0');
+        target.resize(nodes[layer]->reader.read(*entry, target.data(), target.size(), 0));
+        fuse_reply_readlink(req, target.c_str());
+    }
+
+    /** backing file for a passthrough open of `ino`, 0 if it has to be served by read
+     *
+     * Backing files are clones of the file content (see fsx::Reader::cloneContent) and
+     * are registered once per inode, until its last open is released (see releaseBacking).
+     * If the kernel refuses to register them (e.g. because slix does not have
+     * CAP_SYS_ADMIN), passthrough is disabled for the whole mount.
+     */
+    auto openBacking([[maybe_unused]] fuse_req_t req, fuse_ino_t ino, size_t layer, fsx::TocEntry const& entry) -> int {
+        if (!passthrough || nodes[layer]->profile) return 0; // recording needs to see every read
+#if FUSE_MINOR_VERSION >= 16
+        auto lock = std::lock_guard{backingMutex};
+        auto [iter, inserted] = backings.try_emplace(ino);
+        auto& backing = iter->second;
+        backing.opens += 1;
+        if (!inserted) return backing.id;
+
+        auto file = nodes[layer]->reader.cloneContent(entry);
+        if (file.fd == -1) return 0;
+        backing.id = std::max(0, fuse_passthrough_open(req, file.fd));
+        if (backing.id == 0) {
+            passthrough = false;
+            if (verbose) {
+                std::cout << "registering backing file failed, passthrough disabled\n";
+            }
+        }
+        return backing.id;
+#else
+        return 0;
+#endif
+    }
+
+    /** unregisters the backing file of `ino` when its last open is released
+     */
+    void releaseBacking([[maybe_unused]] fuse_req_t req, fuse_ino_t ino) {
+#if FUSE_MINOR_VERSION >= 16
+        auto lock = std::lock_guard{backingMutex};
+        auto iter = backings.find(ino);
+        if (iter == backings.end() || --iter->second.opens > 0) return;
+        if (iter->second.id > 0) {
+            fuse_passthrough_close(req, iter->second.id); // opened files keep their backing file
+        }
+        backings.erase(iter);
+#endif
+    }
+
+    void open(fuse_req_t req, fuse_ino_t ino, fuse_file_info* fi) {
+        if (ino == lockIno) {
+            connectedClients += 1;
+            if (verbose) {
+                std::cout << "connected Clients (+1): " << connectedClients << "\n";
+            }
+            fuse_reply_open(req, fi);
+            return;
+        }
+        auto [layer, entry] = fromIno(ino);
+        if (!entry) {
+            fuse_reply_err(req, ENOENT);
+            return;
+        }
+        if (entry->header.type != 0 && entry->header.type != 3) {
+            fuse_reply_err(req, EISDIR);
+            return;
+        }
+        fi->keep_cache = cache.enabled;
+#if FUSE_MINOR_VERSION >= 16
+        fi->backing_id = openBacking(req, ino, layer, *entry);
+#endif
+        fuse_reply_open(req, fi);
+    }
+
+    /** uncompressed contents are replied as file descriptor range, so they can be spliced
+     */
+    void read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset) {
+        auto [layer, entry] = fromIno(ino);
+        if (!entry) {
+            fuse_reply_err(req, ENOENT);
+            return;
+        }
+        nodes[layer]->recordAccess(*entry, offset, size);
+        if (auto range = nodes[layer]->reader.fileRange(*entry, size, offset)) {
+            auto buf = FUSE_BUFVEC_INIT(range->size);
+            buf.buf[0].flags = static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+            buf.buf[0].fd    = range->fd;
+            buf.buf[0].pos   = range->offset;
+            fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+            return;
+        }
+        thread_local auto buffer = std::vector<char>{};
+        buffer.resize(size);
+        auto ct = nodes[layer]->reader.read(*entry, buffer.data(), size, offset);
+        fuse_reply_buf(req, buffer.data(), ct);
+    }
+
+    void release(fuse_req_t req, fuse_ino_t ino) {
+        if (ino == lockIno) {
+            if (--connectedClients == 0 && onIdle) {
+                onIdle();
+            }
+            if (verbose) {
+                std::cout << "connected Clients (-1): " << connectedClients << "\n";
+            }
+        } else {
+            releaseBacking(req, ino);
+        }
+        fuse_reply_err(req, 0);
+    }
+
+    /** with caching, directory listings are kept by the kernel between opens
+     *
+     * Answering with ENOSYS (FUSE_CAP_NO_OPENDIR_SUPPORT) would save the opendir round
+     * trip, but the kernel then never sees cache_readdir and lists every time.
+     */
+    void opendir(fuse_req_t req, fuse_ino_t ino, fuse_file_info* fi) {
+        if (unionDir(ino).empty()) {
+            fuse_reply_err(req, ENOTDIR);
+            return;
+        }
+        fi->keep_cache    = cache.enabled;
+        fi->cache_readdir = cache.enabled;
+        fuse_reply_open(req, fi);
+    }
+
+    /** lists the union of a directory over all layers
+     *
+     * The offset encodes where to continue: the upper 32bit are the layer index + 1
+     * and the lower 32bit the child index inside this layer. Offset 0 starts with
+     * the slix-lock file in the root directory.
+     */
+    void readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset) {
+        auto const& layers = unionDir(ino);
+        auto buffer = std::vector<char>(size);
+        auto used   = size_t{};
+        auto add = [&](char const* name, struct stat const& st, off_t nextOffset) {
+            auto ct = fuse_add_direntry(req, buffer.data() + used, size - used, name, &st, nextOffset);
+            if (ct > size - used) return false;
+            used += ct;
+            return true;
+        };
+
+        auto layer = size_t{0};
+        auto child = size_t{0};
+        if (offset == 0) {
+            if (ino == FUSE_ROOT_ID && !add("slix-lock", lockStat(), off_t{1} << 32)) {
+                fuse_reply_buf(req, buffer.data(), used);
+                return;
+            }
+        } else {
+            layer = (offset >> 32) - 1;
+            child = offset & 0xffff'ffff;
+        }
+
+        auto name = std::string{};
+        for (bool full = false; layer < layers.size() && !full; ++layer, child = 0) {
+            if (!layers[layer]) continue;
+            auto const& toc = nodes[layer]->reader.toc;
+            auto children   = toc.children(*layers[layer]);
+            for (auto i = child; i < children.size() && !full; ++i) {
+                name = toc.baseName(children[i]);
+                // skip files that are already listed by a previous layer
+                auto hidden = false;
+                for (size_t j{0}; j < layer && !hidden; ++j) {
+                    hidden = layers[j] && nodes[j]->reader.toc.findChild(*layers[j], name);
+                }
+                if (hidden) continue;
+                struct stat st{};
+                nodes[layer]->fillStat(children[i], &st);
+                st.st_ino = toIno(layer, toc.index(children[i]));
+                auto nextOffset = (static_cast<off_t>(layer+1) << 32) | static_cast<off_t>(i+1);
+                full = !add(name.c_str(), st, nextOffset);
+            }
+        }
+        fuse_reply_buf(req, buffer.data(), used);
+    }
+};
@@ -1,16 +1,26 @@
 // SPDX-FileCopyrightText: 2023 S. G. Gottlieb <info.simon@gottliebtfreitag.de>
 // SPDX-License-Identifier: AGPL-3.0-only
 #pragma once
-#define FUSE_USE_VERSION 31
+#define FUSE_USE_VERSION 312
 
+#include "CacheProfile.h"
 #include "GarFuse.h"
+#include "UnionIndex.h"
+#include "Unpack.h"
+#include "UpperLayer.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
 #include <filesystem>
+#include <functional>
 #include <fuse3/fuse.h>
 //#include <fuse/fuse_lowlevel.h>
 //#include <fuse/fuse_common.h>
 #include <iostream>
-#include <signal.h>
+#include <mutex>
+#include <optional>
+#include <sys/statvfs.h>
 #include <unordered_set>
 #include <vector>
 
@@ -20,14 +30,22 @@ struct MyFuse {
     fuse*      fusePtr {nullptr};
     std::filesystem::path mountPoint;
 
-    std::vector<GarFuse> nodes;
-    size_t connectedClients{};
+    Layers nodes; // earlier layers shadow later ones
+    UnionIndex index;
+    std::atomic<size_t> connectedClients{};
+    std::function<void()> onIdle; // called on a fuse worker thread when the last client released slix-lock
     bool verbose;
+    CacheProfile cache;
+    std::optional<UpperLayer> upper; // receives all changes, read only without
+    std::mutex upperMutex;           // serializes changes of the upper layer (e.g. copy up)
 
-    MyFuse(std::vector<GarFuse> nodes_, bool _verbose, std::filesystem::path _mountPoint, std::vector<std::string> options)
+    MyFuse(Layers nodes_, bool _verbose, std::filesystem::path _mountPoint, std::vector<std::string> options, CacheProfile _cache = {}, std::optional<UpperLayer> _upper = {})
         : mountPoint{_mountPoint}
         , nodes{std::move(nodes_)}
-        , verbose{_verbose} {
+        , index{nodes, _verbose}
+        , verbose{_verbose}
+        , cache{_cache}
+        , upper{std::move(_upper)} {
         if (verbose) {
             std::cout << "creating mount point at " << mountPoint << "\n";
         }
@@ -46,6 +64,7 @@ struct MyFuse {
         auto foperations = fuse_operations {
             .getattr  = [](char const* path, struct stat* stbuf, fuse_file_info* fi) {
                 if (path == std::string_view{"/slix-lock"}) {
+                    stbuf->st_ino   = (ino_t{1} << 63) - 1; // outside of the inodes of the layers and the upper layer
                     stbuf->st_nlink = 0;
                     stbuf->st_mode = S_IFREG;
                     stbuf->st_size = 0;
@@ -61,11 +80,11 @@ struct MyFuse {
             .mkdir    = [](char const* path, mode_t m) { return self().mkdir_callback(path, m); },
             .unlink   = [](char const* path) { return self().unlink_callback(path); },
             .rmdir    = [](char const* path) { return self().rmdir_callback(path); },
-            .symlink  = [](char const* path, char const* target) { return self().symlink_callback(path, target); },
-            .rename   = [](char const* path, char const* target, unsigned int flags) { return self().rename_callback(path, target); },
+            .symlink  = [](char const* target, char const* path) { return self().symlink_callback(path, target); },
+            .rename   = [](char const* path, char const* target, unsigned int flags) { return self().rename_callback(path, target, flags); },
             .chmod    = [](char const* path, mode_t m, fuse_file_info*) { return self().chmod_callback(path, m); },
             .chown    = [](char const* path, uid_t uid, gid_t gid, fuse_file_info*) { return self().chown_callback(path, uid, gid); },
-//            .truncate = [](char const* path, off_t offset) -> int { std::cout << "truncate " << path << " " << offset << "\n"; return 0; },
+            .truncate = [](char const* path, off_t size, fuse_file_info* fi) { return self().truncate_callback(path, size, fi); },
             .open     = [](char const* path, fuse_file_info* fi) {
                 if (path == std::string_view{"/slix-lock"}) {
                     self().connectedClients += 1;
@@ -81,9 +100,8 @@ struct MyFuse {
             .statfs   = [](char const* path, struct statvfs* fs) { return self().statfs_callback(path, fs); },
             .release  = [](char const* path, fuse_file_info* fi) {
                 if (path == std::string_view{"/slix-lock"}) {
-                    self().connectedClients -= 1;
-                    if (self().connectedClients == 0) {
-                        raise(SIGUSR1);
+                    if (--self().connectedClients == 0 && self().onIdle) {
+                        self().onIdle();
                     }
                     if (self().verbose) {
                         std::cout << "connected Clients (-1): " << self().connectedClients << "\n";
@@ -92,16 +110,31 @@ struct MyFuse {
                 }
                 return self().release_callback(path, fi);
             },
-            .readdir  = [](char const* path, void* buf, fuse_fill_dir_t filler, off_t, fuse_file_info*, fuse_readdir_flags) {
-                if (path == std::string_view{"/"}) {
-                    filler(buf, "slix-lock", nullptr, 0, {});
+            .opendir  = [](char const*, fuse_file_info* fi) {
+                fi->keep_cache    = self().cache.enabled && !self().cache.writable;
+                fi->cache_readdir = self().cache.enabled && !self().cache.writable;
+                return 0;
+            },
+            .readdir  = [](char const* path, void* buf, fuse_fill_dir_t filler, off_t offset, fuse_file_info*, fuse_readdir_flags) {
+                return self().readdir_callback(path, buf, filler, offset);
+            },
+            .init     = [](fuse_conn_info* conn, fuse_config* cfg) -> void* {
+                cfg->use_ino = 1; // inode numbers from the gar files, files sharing content share an inode
+                auto const& cache = self().cache;
+                cfg->entry_timeout    = cache.timeout();
+                cfg->attr_timeout     = cache.timeout();
+                cfg->negative_timeout = cache.negativeTimeout();
+                cfg->kernel_cache     = cache.enabled; // keep file contents cached between opens
+                cache.apply(conn);
+                if (conn->capable & FUSE_CAP_SPLICE_WRITE) { // replies of read_buf are spliced from the gar files
+                    conn->want |= FUSE_CAP_SPLICE_WRITE | (conn->capable & FUSE_CAP_SPLICE_MOVE);
                 }
-                return self().readdir_callback(path, buf, filler);
+                return fuse_get_context()->private_data;
             },
-            .lock     = [](char const* path, fuse_file_info* fi, int cmd, flock* l) { return self().lock_callback(path, fi, cmd, l); },
-            .utimens  = [](char const* path, struct timespec const tv[2], fuse_file_info*) { return self().utimens_callback(path, tv); }
+            .create   = [](char const* path, mode_t m, fuse_file_info* fi) { return self().create_callback(path, m, fi); },
+            .utimens  = [](char const* path, struct timespec const tv[2], fuse_file_info*) { return self().utimens_callback(path, tv); },
             //.access   = [](char const* path, int mask) { std::cout << "access: " << path << "\n"; if (auto res = access(path, mask); res == -1) return -errno; return 0; },
-//            .read_buf = [](char const* path, fuse_bufvec** bufp, size_t size, off_t offset, fuse_file_info* fi) { return self().read_buf_callback(path, bufp, size, offset, fi); },
+            .read_buf = [](char const* path, fuse_bufvec** bufp, size_t size, off_t offset, fuse_file_info* fi) { return self().read_buf_callback(path, bufp, size, offset, fi); },
 //            .lseek    = [](char const* path, off_t off, int whence) -> off_t { std::cout << "lseek not implemented: " << path << "\n"; return 0; },
 
         };
@@ -126,8 +159,24 @@ struct MyFuse {
         fuse_unmount(fusePtr);
     }
 
-    void loop() {
-        fuse_loop(fusePtr);
+    /** serves requests until unmounted, with `threads` > 1 requests are handled concurrently
+     */
+    void loop(size_t threads = 1) {
+        if (threads <= 1) {
+            fuse_loop(fusePtr);
+            return;
+        }
+#if FUSE_MINOR_VERSION >= 12
+        auto config = fuse_loop_cfg_create();
+        fuse_loop_cfg_set_max_threads(config, threads);
+        fuse_loop_cfg_set_idle_threads(config, threads);
+        fuse_loop_cfg_set_clone_fd(config, 1); // one /dev/fuse file descriptor per thread
+        fuse_loop_mt(fusePtr, config);
+        fuse_loop_cfg_destroy(config);
+#else // no limit of the number of threads before libfuse 3.12
+        auto config = fuse_loop_config{.clone_fd = 1, .max_idle_threads = static_cast<unsigned int>(threads)};
+        fuse_loop_mt(fusePtr, &config);
+#endif
     }
 
 
@@ -137,54 +186,358 @@ struct MyFuse {
         return *fusefs;
     }
 
+    /** node of the layers providing `path`, unless it was deleted through the upper layer
+     */
+    auto lowerNode(std::string_view path) -> UnionIndex::Node* {
+        if (upper && upper->hides(path)) return nullptr;
+        return index.find(path);
+    }
+
+    /** true if `path` exists in the upper layer, fills `st` if given
+     */
+    auto inUpper(char const* path, struct stat* st = nullptr) const -> bool {
+        if (!upper) return false;
+        if (UpperLayer::isInternal(std::filesystem::path{path}.filename().string())) return false;
+        struct stat tmp;
+        return ::lstat(upper->realPath(path).c_str(), st ? st : &tmp) == 0;
+    }
+
+    static auto upperFd(fuse_file_info const* fi) -> int {
+        return (fi && fi->fh) ? static_cast<int>(fi->fh - 1) : -1; // 0 marks files of the layers
+    }
+
+    /** copies an entry of the layers (and its parent directories) into the upper layer
+     *
+     * Must be called with `upperMutex` locked.
+     */
+    int copyUp(std::string_view path) {
+        if (path == "/" || upper->contains(path)) return 0;
+        auto node = lowerNode(path);
+        if (!node) return -ENOENT;
+        if (auto r = copyUp(std::filesystem::path{path}.parent_path().string()); r != 0) return r;
+
+        auto& layer   = *nodes[node->layer];
+        auto const& e = *node->entry;
+        auto real     = upper->realPath(path);
+        if (e.header.type == 1) {
+            // owner keeps full access, entries below a read only directory are copied up or created later
+            if (::mkdir(real.c_str(), e.header.perms | S_IRWXU) != 0) return -errno;
+        } else if (e.header.type == 2) {
+            auto target = std::string(e.header.size + 1, '\0');
+            if (auto r = layer.readlink_callback(&e, target.data(), target.size()); r != 0) return r;
+            if (::symlink(target.c_str(), real.c_str()) != 0) return -errno;
+        } else {
+            try {
+                Unpack::writeFile(layer, e, real);
+            } catch (std::exception const& ex) {
+                fmt::print(stderr, "failed copying up {}: {}\n", path, ex.what());
+                return -EIO;
+            }
+        }
+        if (verbose) {
+            fmt::print("copied up {}\n", path);
+        }
+        return 0;
+    }
+
+    /** names in a directory of the merged view, upper entries first
+     */
+    int listDir(char const* path, std::vector<std::string>& names) {
+        struct stat st;
+        auto isUpperDir = inUpper(path, &st);
+        if (isUpperDir && !S_ISDIR(st.st_mode)) return -ENOTDIR;
+        if (isUpperDir) {
+            auto ec = std::error_code{};
+            for (auto const& e : std::filesystem::directory_iterator{upper->realPath(path), ec}) {
+                auto name = e.path().filename().string();
+                if (!UpperLayer::isInternal(name)) names.push_back(name);
+            }
+            if (ec) return -ec.value();
+        }
+        auto upperNames = names.size();
+        auto node = (isUpperDir && upper->isOpaque(path)) ? nullptr : lowerNode(path);
+        if (node && node->entry->header.type == 1) {
+            auto prefix = (path == std::string_view{"/"}) ? std::string{} : std::string{path};
+            for (auto name : index.children(*node)) {
+                auto childPath = prefix + "/" + std::string{name};
+                if (upper && upper->hasWhiteout(childPath)) continue; // parents are checked by lowerNode(path)
+                if (std::find(names.begin(), names.begin() + upperNames, name) != names.begin() + upperNames) continue;
+                names.emplace_back(name);
+            }
+        } else if (!isUpperDir) {
+            return node ? -ENOTDIR : -ENOENT;
+        }
+        return 0;
+    }
+
+    /** attributes of the layer providing `path`, the layer index is added to the inode number
+     *
+     * Entries of the upper layer are marked by the highest bit.
+     */
+    int getattr_callback(char const* path, struct stat* stbuf) {
+        if (inUpper(path, stbuf)) {
+            stbuf->st_ino |= ino_t{1} << 63;
+            return 0;
+        }
+        if (upper && UpperLayer::isInternal(std::filesystem::path{path}.filename().string())) return -ENOENT;
+        auto node = lowerNode(path);
+        if (!node) return -ENOENT;
+        auto const& fs = *nodes[node->layer];
+        fs.fillStat(*node->entry, stbuf);
+        stbuf->st_ino = fs.inode(*node->entry) | (static_cast<ino_t>(node->layer) << 48);
+        return 0;
+    }
+    int readlink_callback(char const* path, char* targetBuf, size_t size) {
+        if (inUpper(path)) {
+            auto ct = ::readlink(upper->realPath(path).c_str(), targetBuf, size - 1);
+            if (ct == -1) return -errno;
+            targetBuf[ct] = '\0';
+            return 0;
+        }
+        auto node = lowerNode(path);
+        if (!node) return -ENOENT;
+        return nodes[node->layer]->readlink_callback(node->entry, targetBuf, size);
+    }
+
+    /** runs `cb` with the parent of `path` copied up, `path` itself must not exist yet
+     *
+     * A whiteout of `path` is removed, `cb` gets true if `path` hides an entry of the layers.
+     */
     template <typename CB>
-    static int any_callback(CB && cb) {
-        for (auto& fs : self().nodes) {
-            auto r = cb(fs);
-            if (r != -ENOENT) return r;
-        }
-        return -ENOENT;
-    }
-
-
-    #define fwd_callback(name) \
-        template <typename ...Args> \
-        int name(char const* path, Args&&... args) { \
-            auto r = any_callback([&](auto& fs) -> int { \
-                if constexpr (requires { fs.name(path, std::forward<Args>(args)...); }) { \
-                    return fs.name(path, std::forward<Args>(args)...); \
-                } \
-                return -ENOENT; \
-            }); \
-            return r; \
-        }
-    fwd_callback(getattr_callback)
-    fwd_callback(readlink_callback)
-    fwd_callback(mknod_callback)
-    fwd_callback(mkdir_callback)
-    fwd_callback(unlink_callback)
-    fwd_callback(rmdir_callback)
-    fwd_callback(symlink_callback)
-    fwd_callback(rename_callback)
-    fwd_callback(chmod_callback)
-    fwd_callback(chown_callback)
-    fwd_callback(open_callback)
-    fwd_callback(read_callback)
-    fwd_callback(write_callback)
-    fwd_callback(statfs_callback);
-    fwd_callback(release_callback)
-    int readdir_callback(char const* path, void* buf, fuse_fill_dir_t filler) {
-        auto satisfiedFiles = std::unordered_set<std::string>{};
-        for (auto& fs : nodes) {
-            fs.readdir_callback(path, buf, filler, satisfiedFiles);
-        }
-//        std::cout << "reporting files:\n";
-//        for (auto s : satisfiedFiles) {
-//            std::cout << "  " << s << "\n";
-//        }
+    int createUpper(char const* path, CB const& cb) {
+        if (!upper) return -EROFS;
+        if (UpperLayer::isInternal(std::filesystem::path{path}.filename().string())) return -EINVAL; // reserved for whiteouts
+        auto lock = std::lock_guard{upperMutex};
+        if (inUpper(path) || lowerNode(path)) return -EEXIST;
+        if (auto r = copyUp(std::filesystem::path{path}.parent_path().string()); r != 0) return r;
+        upper->removeWhiteout(path);
+        return cb(index.find(path) != nullptr);
+    }
+
+    /** runs `cb` with `path` copied up
+     */
+    template <typename CB>
+    int changeUpper(char const* path, CB const& cb) {
+        if (!upper) return -EROFS;
+        auto lock = std::lock_guard{upperMutex};
+        if (auto r = copyUp(path); r != 0) return r;
+        return cb(upper->realPath(path));
+    }
+
+    int mknod_callback(char const* path, mode_t m, dev_t d) {
+        return createUpper(path, [&](bool) {
+            return (::mknod(upper->realPath(path).c_str(), m, d) == 0) ? 0 : -errno;
+        });
+    }
+    int mkdir_callback(char const* path, mode_t m) {
+        return createUpper(path, [&](bool hidesLower) {
+            if (::mkdir(upper->realPath(path).c_str(), m) != 0) return -errno;
+            return hidesLower ? upper->setOpaque(path) : 0; // replaces a deleted directory, without its content
+        });
+    }
+    int symlink_callback(char const* path, char const* target) {
+        return createUpper(path, [&](bool) {
+            return (::symlink(target, upper->realPath(path).c_str()) == 0) ? 0 : -errno;
+        });
+    }
+    int create_callback(char const* path, mode_t m, fuse_file_info* fi) {
+        return createUpper(path, [&](bool) {
+            auto fd = ::open(upper->realPath(path).c_str(), fi->flags | O_CREAT | O_CLOEXEC, m);
+            if (fd == -1) return -errno;
+            fi->fh = static_cast<uint64_t>(fd) + 1;
+            return 0;
+        });
+    }
+
+    /** removes `path` from the upper layer and hides it in the layers below by a whiteout
+     */
+    int removeUpper(char const* path, bool directory) {
+        if (!upper) return -EROFS;
+        auto lock = std::lock_guard{upperMutex};
+        auto node = lowerNode(path);
+        struct stat st;
+        auto isUpper = inUpper(path, &st);
+        if (!isUpper && !node) return -ENOENT;
+        auto isDir = isUpper ? S_ISDIR(st.st_mode) : (node->entry->header.type == 1);
+        if (directory && !isDir) return -ENOTDIR;
+        if (!directory && isDir) return -EISDIR;
+        if (directory) {
+            auto names = std::vector<std::string>{};
+            if (auto r = listDir(path, names); r != 0) return r;
+            if (!names.empty()) return -ENOTEMPTY;
+        }
+        if (node) {
+            if (auto r = copyUp(std::filesystem::path{path}.parent_path().string()); r != 0) return r;
+        }
+        if (isUpper) {
+            if (directory) upper->clearInternal(path);
+            if (::remove(upper->realPath(path).c_str()) != 0) return -errno;
+        }
+        return node ? upper->addWhiteout(path) : 0;
+    }
+    int unlink_callback(char const* path) {
+        return removeUpper(path, false);
+    }
+    int rmdir_callback(char const* path) {
+        return removeUpper(path, true);
+    }
+
+    /** renames inside the upper layer, files of the layers are copied up first
+     *
+     * Directories of the layers are not copied up recursively, this fails with EXDEV
+     * (mv falls back to copying).
+     */
+    int rename_callback(char const* path, char const* target, unsigned int flags) {
+        if (!upper) return -EROFS;
+        if (flags & RENAME_EXCHANGE) return -EINVAL;
+        if (UpperLayer::isInternal(std::filesystem::path{target}.filename().string())) return -EINVAL;
+        auto lock = std::lock_guard{upperMutex};
+        struct stat st;
+        auto node = lowerNode(path);
+        auto isUpper = inUpper(path, &st);
+        if (!isUpper && !node) return -ENOENT;
+        auto isDir = isUpper ? S_ISDIR(st.st_mode) : (node->entry->header.type == 1);
+        if (isDir && node) return -EXDEV;
+
+        auto targetNode = lowerNode(target);
+        auto targetIsUpper = inUpper(target, &st);
+        if ((targetIsUpper || targetNode) && (flags & RENAME_NOREPLACE)) return -EEXIST;
+        if (targetNode && !targetIsUpper) { // rename(2) below only checks the upper layer
+            auto targetIsDir = targetNode->entry->header.type == 1;
+            if (isDir && !targetIsDir) return -ENOTDIR;
+            if (!isDir && targetIsDir) return -EISDIR;
+        }
+        if (isDir && (targetIsUpper || targetNode)) {
+            auto names = std::vector<std::string>{};
+            if (auto r = listDir(target, names); r != 0) return r;
+            if (!names.empty()) return -ENOTEMPTY;
+        }
+
+        if (auto r = copyUp(path); r != 0) return r;
+        if (auto r = copyUp(std::filesystem::path{target}.parent_path().string()); r != 0) return r;
+        if (isDir && targetIsUpper) upper->clearInternal(target);
+        if (::rename(upper->realPath(path).c_str(), upper->realPath(target).c_str()) != 0) return -errno;
+        upper->removeWhiteout(target);
+        if (isDir && index.find(target)) {
+            upper->setOpaque(target); // entries of the layers must not show up in a moved directory
+        }
+        return node ? upper->addWhiteout(path) : 0;
+    }
+    int chmod_callback(char const* path, mode_t m) {
+        return changeUpper(path, [&](auto const& real) {
+            return (::chmod(real.c_str(), m) == 0) ? 0 : -errno;
+        });
+    }
+    int chown_callback(char const* path, uid_t uid, gid_t gid) {
+        return changeUpper(path, [&](auto const& real) {
+            return (::lchown(real.c_str(), uid, gid) == 0) ? 0 : -errno;
+        });
+    }
+    int utimens_callback(char const* path, struct timespec const tv[2]) {
+        return changeUpper(path, [&](auto const& real) {
+            return (::utimensat(AT_FDCWD, real.c_str(), tv, AT_SYMLINK_NOFOLLOW) == 0) ? 0 : -errno;
+        });
+    }
+    int truncate_callback(char const* path, off_t size, fuse_file_info* fi) {
+        if (auto fd = upperFd(fi); fd != -1) {
+            return (::ftruncate(fd, size) == 0) ? 0 : -errno;
+        }
+        return changeUpper(path, [&](auto const& real) {
+            return (::truncate(real.c_str(), size) == 0) ? 0 : -errno;
+        });
+    }
+
+    /** files of the upper layer are opened as real files, opening for writing copies up first
+     */
+    int open_callback(char const* path, fuse_file_info* fi) {
+        auto writing = (fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC);
+        if (writing && !upper) return -EROFS;
+        if (writing) {
+            auto lock = std::lock_guard{upperMutex};
+            if (auto r = copyUp(path); r != 0) return r;
+        }
+        if (inUpper(path)) {
+            auto fd = ::open(upper->realPath(path).c_str(), fi->flags & ~(O_CREAT | O_EXCL | O_NOCTTY), 0);
+            if (fd == -1) return -errno;
+            fi->fh = static_cast<uint64_t>(fd) + 1;
+            return 0;
+        }
+        auto node = lowerNode(path);
+        if (!node) return -ENOENT;
+        return nodes[node->layer]->open_callback(node->entry, fi);
+    }
+    int read_callback(char const* path, char* buf, size_t size, off_t offset, fuse_file_info* fi) {
+        if (auto fd = upperFd(fi); fd != -1) {
+            auto ct = ::pread(fd, buf, size, offset);
+            return (ct == -1) ? -errno : static_cast<int>(ct);
+        }
+        auto node = lowerNode(path);
+        if (!node) return -ENOENT;
+        return nodes[node->layer]->read_callback(node->entry, buf, size, offset, fi);
+    }
+    int read_buf_callback(char const* path, fuse_bufvec** bufp, size_t size, off_t offset, fuse_file_info* fi) {
+        if (auto fd = upperFd(fi); fd != -1) { // read (or spliced) by libfuse
+            auto vec = static_cast<fuse_bufvec*>(std::malloc(sizeof(fuse_bufvec)));
+            if (!vec) return -ENOMEM;
+            *vec = FUSE_BUFVEC_INIT(size);
+            vec->buf[0].flags = static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+            vec->buf[0].fd    = fd;
+            vec->buf[0].pos   = offset;
+            *bufp = vec;
+            return 0;
+        }
+        auto node = lowerNode(path);
+        if (!node) return -ENOENT;
+        return nodes[node->layer]->read_buf_callback(node->entry, bufp, size, offset);
+    }
+    int write_callback(char const* path, char const* buf, size_t size, off_t offset, fuse_file_info* fi) {
+        auto fd = upperFd(fi);
+        if (fd == -1) return -EBADF;
+        auto ct = ::pwrite(fd, buf, size, offset);
+        return (ct == -1) ? -errno : static_cast<int>(ct);
+    }
+    int statfs_callback(char const* path, struct statvfs* fs) {
+        if (!upper) { // same as libfuse without statfs
+            *fs = {};
+            fs->f_namemax = 255;
+            fs->f_bsize   = 512;
+            return 0;
+        }
+        return (::statvfs(upper->dir.c_str(), fs) == 0) ? 0 : -errno;
+    }
+    int release_callback(char const* path, fuse_file_info* fi) {
+        if (auto fd = upperFd(fi); fd != -1) {
+            ::close(fd);
+        }
+        return 0;
+    }
+    /** lists a directory of the union index, merged with the upper layer
+     *
+     * The offset is the number of entries already listed, the root directory
+     * starts with the slix-lock file.
+     */
+    int readdir_callback(char const* path, void* buf, fuse_fill_dir_t filler, off_t offset) {
+        auto skip = (path == std::string_view{"/"}) ? size_t{1} : size_t{0};
+        if (upper) {
+            auto names = std::vector<std::string>{};
+            if (auto r = listDir(path, names); r != 0) return r;
+            for (auto pos = static_cast<size_t>(offset); pos < names.size() + skip; ++pos) {
+                auto const& name = (pos < skip) ? std::string{"slix-lock"} : names[pos - skip];
+                if (filler(buf, name.c_str(), nullptr, static_cast<off_t>(pos + 1), {})) break;
+            }
+            return 0;
+        }
+        auto node = index.find(path);
+        if (!node) return -ENOENT;
+        if (node->entry->header.type != 1) return -ENOTDIR;
+
+        auto children = index.children(*node);
+        auto name = std::string{};
+        for (auto pos = static_cast<size_t>(offset); pos < children.size() + skip; ++pos) {
+            name = (pos < skip) ? std::string_view{"slix-lock"} : children[pos - skip];
+            if (filler(buf, name.c_str(), nullptr, static_cast<off_t>(pos + 1), {})) break;
+        }
         return 0;
     }
-    fwd_callback(lock_callback)
-    fwd_callback(utimens_callback)
 };
 
@@ -23,6 +23,7 @@ struct PackageIndex {
         std::string hash;
         std::string description;
         std::vector<std::string> dependencies;
+        std::string merkle; // root of the Merkle tree of the gar file (hex), empty if not available
     };
     std::unordered_map<std::string, std::vector<Info>> packages;
 
@@ -49,6 +50,9 @@ struct PackageIndex {
                 for (auto const& i : info.dependencies) {
                     node2["dependencies"].push_back(i);
                 }
+                if (!info.merkle.empty()) {
+                    node2["merkle"] = info.merkle;
+                }
                 node["versions"].push_back(node2);
             }
             yaml["packages"].push_back(node);
@@ -80,6 +84,9 @@ struct PackageIndex {
                 for (auto d : e["dependencies"]) {
                     info.dependencies.push_back(d.as<std::string>());
                 }
+                if (e["merkle"]) {
+                    info.merkle = e["merkle"].as<std::string>();
+                }
                 packages[name].push_back(info);
             }
         }
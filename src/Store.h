@@ -2,6 +2,8 @@
 // SPDX-License-Identifier: AGPL-3.0-only
 #pragma once
 
+#include "ChunkStore.h"
+#include "ExtractCache.h"
 #include "error_fmt.h"
 
 #include <filesystem>
@@ -13,12 +15,21 @@
 #include <yaml-cpp/yaml.h>
 
 struct StoreConfig {
-    std::string           type;
+    std::string           type; // "local" or "experimental-chunked", see isChunked()
     struct Source {
         std::string           type;
         std::filesystem::path url;
     } source;
 
+    /** installed packages are deduplicated into a ChunkStore
+     *
+     * Experimental: it saves disk space, but packages are still downloaded as a
+     * whole, servers do not publish chunks yet.
+     */
+    auto isChunked() const -> bool {
+        return type == "experimental-chunked";
+    }
+
     static auto defaultStoreConfig() {
         return StoreConfig {
             .type = "local",
@@ -186,6 +197,18 @@ public:
         return getSlixStatePath() / this->name / "packages" / (fullPackageName + ".gar");
     }
 
+    /** chunks shared by all packages of a chunked store, see StoreConfig::isChunked
+     */
+    auto getChunkStore() const -> ChunkStore {
+        return ChunkStore{getSlixStatePath() / this->name / "chunks"};
+    }
+
+    /** files extracted from packages of this store, see slix mount --unpack --cache
+     */
+    auto getExtractCache() const -> ExtractCache {
+        return ExtractCache{getSlixStatePath() / this->name / "extracted"};
+    }
+
     bool isInstalled(std::string fullPackageName) const {
         return state.isInstalled(fullPackageName);
     }
@@ -201,7 +224,7 @@ public:
 
 
         StoreConfig::Source const& source = config.source;
-        if (config.type == "local") {
+        if (config.type == "local" || config.isChunked()) {
 
             auto package = pattern + ".gar.zst";
             auto src  = "https://" + (source.url / package).string();
@@ -216,6 +239,9 @@ public:
                 throw error_fmt{"unknown source type {}", source.type};
             }
             unpackZstFile(dest);
+            if (config.isChunked()) {
+                getChunkStore().convertToManifest(getPackagePath(pattern));
+            }
 
             state.packages[name].insert(pattern);
         } else {
@@ -233,11 +259,15 @@ public:
 
 
         StoreConfig::Source const& source = config.source;
-        if (config.type == "local") {
+        if (config.type == "local" || config.isChunked()) {
             auto package = pattern + ".gar";
             auto dest = getSlixStatePath() / this->name / "packages" / package;
 
             std::filesystem::remove(dest);
+            if (config.isChunked()) {
+                getChunkStore().collectGarbage(dest.parent_path());
+            }
+            getExtractCache().removePackage(pattern);
             state.packages[name].erase(pattern);
         } else {
             throw error_fmt{"unknown store type {}", config.type};
@@ -0,0 +1,133 @@
+// SPDX-FileCopyrightText: 2023 S. G. Gottlieb <info.simon@gottliebtfreitag.de>
+// SPDX-License-Identifier: AGPL-3.0-only
+#pragma once
+
+#include "GarFuse.h"
+
+#include <algorithm>
+#include <fmt/format.h>
+#include <mutex>
+#include <shared_mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Merged view of the rootfs of multiple gar files
+ *
+ * Maps each path (e.g. "/usr/bin/foo") to the layer and entry providing it.
+ * Precedence rules:
+ *   - layers are ordered, an earlier layer wins over a later one
+ *   - directories of all layers are merged, as long as no earlier layer provides
+ *     a non directory under the same path
+ *   - everything else of a later layer is hidden (shadowed)
+ *
+ * Directories are merged on first use, so mounting does not have to walk all
+ * entries of all layers. All functions are thread safe.
+ */
+struct UnionIndex {
+    struct Node {
+        size_t               layer;
+        fsx::TocEntry const* entry;
+
+        // only directories
+        std::vector<std::tuple<size_t, fsx::TocEntry const*>> sources; // same directory in each layer that is merged
+        bool                          merged{false};
+        std::vector<std::string_view> children; // base names of all visible children, sorted (once merged)
+    };
+
+    Layers const* layers{nullptr};
+    bool                        verbose{false};
+
+    // keys point into the tables of contents of the layers
+    std::shared_mutex                          mutex;
+    std::unordered_map<std::string_view, Node> nodes;
+    size_t shadowed{}; // number of entries hidden by an earlier layer (of merged directories)
+
+    UnionIndex(Layers const& _layers, bool _verbose)
+        : layers{&_layers}
+        , verbose{_verbose}
+    {
+        for (size_t layer{0}; layer < layers->size(); ++layer) {
+            auto root = (*layers)[layer]->findEntry("/");
+            if (!root || root->header.type != 1) continue;
+            auto [iter, inserted] = nodes.try_emplace("/", Node{layer, root});
+            iter->second.sources.emplace_back(layer, root);
+        }
+        if (verbose) { // report all shadowed entries right away
+            mergeAll("/");
+            fmt::print("{} entries are shadowed by earlier packages\n", shadowed);
+        }
+    }
+    UnionIndex(UnionIndex const&) = delete;
+
+    auto find(std::string_view path) -> Node* {
+        {
+            auto lock = std::shared_lock{mutex};
+            if (auto iter = nodes.find(path); iter != nodes.end()) return &iter->second;
+        }
+        // unknown paths are either not merged yet or do not exist
+        auto pos = path.rfind('/');
+        if (path == "/" || pos == std::string_view::npos) return nullptr;
+        auto parent = find(pos == 0 ? std::string_view{"/"} : path.substr(0, pos));
+        if (!parent || parent->entry->header.type != 1) return nullptr;
+        merge(*parent);
+
+        auto lock = std::shared_lock{mutex};
+        if (auto iter = nodes.find(path); iter != nodes.end()) return &iter->second;
+        return nullptr;
+    }
+
+    /** names of all entries of a directory
+     */
+    auto children(Node& dir) -> std::span<std::string_view const> {
+        merge(dir);
+        return dir.children;
+    }
+
+private:
+    /** adds the children of a directory of all layers
+     */
+    void merge(Node& dir) {
+        {
+            auto lock = std::shared_lock{mutex};
+            if (dir.merged) return;
+        }
+        auto lock = std::unique_lock{mutex};
+        if (dir.merged) return;
+        for (auto [layer, source] : dir.sources) {
+            auto const& toc = (*layers)[layer]->reader.toc;
+            for (auto const& child : toc.children(*source)) {
+                auto path = toc.name(child).substr(GarFuse::rootfs.size()); // e.g. "rootfs/usr" -> "/usr"
+                auto [iter, inserted] = nodes.try_emplace(path, Node{layer, &child});
+                auto& node = iter->second;
+                if (inserted) {
+                    dir.children.push_back(toc.baseName(child));
+                } else if (node.entry->header.type != 1 || child.header.type != 1) {
+                    shadowed += 1;
+                    if (verbose) {
+                        fmt::print("{} of {} is shadowed by {}\n", path, (*layers)[layer]->name, (*layers)[node.layer]->name);
+                    }
+                    continue;
+                }
+                if (child.header.type == 1) {
+                    node.sources.emplace_back(layer, &child);
+                }
+            }
+        }
+        std::ranges::sort(dir.children);
+        dir.merged = true;
+    }
+
+    void mergeAll(std::string const& path) {
+        auto node = find(path);
+        if (!node || node->entry->header.type != 1) return;
+        auto prefix = (path == "/") ? std::string{} : path;
+        for (auto name : children(*node)) {
+            mergeAll(prefix + "/" + std::string{name});
+        }
+    }
+};
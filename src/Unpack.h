@@ -0,0 +1,204 @@
+// SPDX-FileCopyrightText: 2023 S. G. Gottlieb <info.simon@gottliebtfreitag.de>
+// SPDX-License-Identifier: AGPL-3.0-only
+#pragma once
+
+#include "ExtractCache.h"
+#include "GarFuse.h"
+#include "UnionIndex.h"
+#include "error_fmt.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <exception>
+#include <fcntl.h>
+#include <filesystem>
+#include <fmt/format.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <tuple>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * Extracts the merged view of multiple gar files into a directory, without going through fuse
+ *
+ * Precedence is the same as for a mount (see UnionIndex). Directories are created
+ * first, files and symlinks are then written by `threads` threads. Uncompressed
+ * contents are copied inside the kernel with copy_file_range (which reflinks if the
+ * gar file and the target are on the same btrfs/xfs), entries sharing their
+ * content become hard links.
+ * With an ExtractCache for a layer, its files are extracted into the cache once
+ * and linked from there (see ExtractCache::materialize).
+ */
+struct Unpack {
+    struct Job {
+        std::filesystem::path dest;
+        size_t                layer;
+        fsx::TocEntry const*  entry;
+    };
+
+    Layers const&              layers;
+    std::filesystem::path      target;
+    bool                       verbose;
+    std::vector<ExtractCache*> caches{}; // per layer (or empty), nullptr if the layer is extracted without cache
+
+    std::vector<std::unique_ptr<ExtractCache::Index>> indices; // per layer with cache
+
+    std::vector<Job>                                      jobs;
+    std::vector<std::tuple<std::filesystem::path, std::filesystem::path>> links; // dest, extracted file with the same content
+    std::vector<std::tuple<std::filesystem::path, mode_t>> dirs; // permissions are set last, they might forbid writing
+
+    void run(size_t threads) {
+        auto index = UnionIndex{layers, verbose};
+        for (auto const& layer : layers) {
+            if (verbose && !layer->findEntry("/")) { // e.g. only meta data, skipped by the index
+                fmt::print("{} has no rootfs, nothing to unpack\n", layer->name);
+            }
+        }
+        auto firstOfContent = std::map<std::tuple<size_t, uint64_t>, std::filesystem::path>{};
+        collect(index, "/", firstOfContent);
+        indices.resize(layers.size());
+        auto cacheLocks = std::vector<ExtractCache::Lock>{}; // until the indices are stored
+        for (size_t i{0}; i < caches.size(); ++i) {
+            if (caches[i]) {
+                cacheLocks.push_back(caches[i]->lock(/*.exclusive=*/false));
+                indices[i] = caches[i]->loadIndex(layers[i]->reader.path.stem().string(), layers[i]->reader.path);
+            }
+        }
+
+        auto errors = std::vector<std::exception_ptr>(jobs.size());
+        auto next   = std::atomic<size_t>{0};
+        {
+            auto workers = std::vector<std::jthread>{};
+            for (size_t t{0}; t < std::min(std::max<size_t>(threads, 1), jobs.size()); ++t) {
+                workers.emplace_back([&]() {
+                    for (auto i = next++; i < jobs.size(); i = next++) {
+                        try {
+                            extract(jobs[i]);
+                        } catch (...) {
+                            errors[i] = std::current_exception();
+                        }
+                    }
+                });
+            }
+        }
+        for (size_t i{0}; i < indices.size(); ++i) { // also keep what was extracted before a failure
+            if (indices[i] && indices[i]->changed) {
+                caches[i]->storeIndex(*indices[i]);
+            }
+        }
+        cacheLocks.clear();
+        for (auto const& e : errors) {
+            if (e) {
+                std::rethrow_exception(e);
+            }
+        }
+        for (auto const& [dest, source] : links) {
+            std::filesystem::remove(dest);
+            std::filesystem::create_hard_link(source, dest);
+        }
+        for (auto iter = dirs.rbegin(); iter != dirs.rend(); ++iter) { // children before their parents
+            std::filesystem::permissions(std::get<0>(*iter), static_cast<std::filesystem::perms>(std::get<1>(*iter)));
+        }
+    }
+
+private:
+    void collect(UnionIndex& index, std::string const& path, std::map<std::tuple<size_t, uint64_t>, std::filesystem::path>& firstOfContent) {
+        auto dir = index.find(path);
+        if (!dir) return; // no package has a rootfs
+        auto prefix = (path == "/") ? std::string{} : path;
+        for (auto name : index.children(*dir)) {
+            auto childPath = prefix + "/" + std::string{name};
+            auto node = index.find(childPath);
+            auto dest = target / childPath.substr(1);
+            auto const& e = *node->entry;
+            if (e.header.type == 1) {
+                std::filesystem::create_directories(dest);
+                dirs.emplace_back(dest, e.header.perms);
+                collect(index, childPath, firstOfContent);
+            } else if (e.header.type != 2 && e.linkCount > 1) {
+                auto [iter, inserted] = firstOfContent.try_emplace({node->layer, e.fileOffset}, dest);
+                if (inserted) {
+                    jobs.emplace_back(dest, node->layer, &e);
+                } else {
+                    links.emplace_back(dest, iter->second);
+                }
+            } else {
+                jobs.emplace_back(dest, node->layer, &e);
+            }
+        }
+    }
+
+    void extract(Job const& job) {
+        auto& layer = *layers[job.layer];
+        auto const& e = *job.entry;
+        if (e.header.type == 2) {
+            auto linkTarget = std::string(e.header.size, '\0');
+            layer.reader.read(e, linkTarget.data(), linkTarget.size(), 0);
+            std::filesystem::remove(job.dest);
+            std::filesystem::create_symlink(linkTarget, job.dest);
+            return;
+        }
+        auto cache = job.layer < caches.size() ? caches[job.layer] : nullptr;
+        if (!cache) {
+            writeFile(layer, e, job.dest);
+            return;
+        }
+
+        auto& index  = *indices[job.layer];
+        auto  entry  = layer.reader.toc.index(e);
+        auto  object = index.find(entry);
+        if (object.empty() || !exists(cache->objectPath(object))) {
+            auto tmpPath = cache->tempPath();
+            writeFile(layer, e, tmpPath);
+            object = cache->add(tmpPath);
+            index.set(entry, object);
+        }
+        cache->materialize(object, job.dest);
+    }
+
+public:
+    /** writes the content of an entry to `dest` (replacing it), with the permissions of the entry
+     */
+    static void writeFile(GarFuse& layer, fsx::TocEntry const& e, std::filesystem::path const& dest) {
+        auto& reader = layer.reader;
+        std::filesystem::remove(dest); // never write through an existing (maybe hard linked or read only) file
+        auto out = fsx::File{};
+        out.fd = ::open(dest.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0600);
+        if (out.fd == -1) {
+            throw error_fmt{"failed creating {}: {}", dest, strerror(errno)};
+        }
+        auto pos = uint64_t{};
+        if (auto range = reader.fileRange(e, e.header.size, 0)) {
+            auto offset = static_cast<off_t>(range->offset);
+            while (pos < range->size) {
+                auto ct = ::copy_file_range(range->fd, &offset, out.fd, nullptr, range->size - pos, 0);
+                if (ct <= 0) break; // not supported between these file systems, copied below
+                pos += ct;
+            }
+        }
+        thread_local auto buffer = std::vector<char>(1<<20);
+        while (pos < e.header.size) {
+            auto ct = reader.read(e, buffer.data(), buffer.size(), pos);
+            if (ct == 0) {
+                throw error_fmt{"failed reading {} of {}", reader.toc.name(e), layer.name};
+            }
+            for (size_t written{0}; written < ct;) {
+                auto w = ::pwrite(out.fd, buffer.data() + written, ct - written, pos + written);
+                if (w <= 0) {
+                    throw error_fmt{"failed writing {}: {}", dest, strerror(errno)};
+                }
+                written += w;
+            }
+            pos += ct;
+        }
+        if (::fchmod(out.fd, e.header.perms) != 0) {
+            throw error_fmt{"failed setting permissions of {}: {}", dest, strerror(errno)};
+        }
+    }
+};
@@ -0,0 +1,107 @@
+// SPDX-FileCopyrightText: 2023 S. G. Gottlieb <info.simon@gottliebtfreitag.de>
+// SPDX-License-Identifier: AGPL-3.0-only
+#pragma once
+
+#include <cerrno>
+#include <fcntl.h>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Writable directory on top of the read only layers of a mount
+ *
+ * Works like the upper directory of overlayfs: everything that is created or
+ * changed lives in `dir`, files of the layers below are copied up before they are
+ * changed. Deleting an entry of a lower layer leaves a whiteout, an empty file
+ * named ".wh.<name>" next to it. A directory that replaced a deleted one hides
+ * all lower entries below it, it is marked opaque by a ".wh..wh..opq" file.
+ * Names starting with ".wh." are not visible through the mount.
+ */
+struct UpperLayer {
+    std::filesystem::path dir;
+
+    static constexpr auto whiteoutPrefix = std::string_view{".wh."};
+    static constexpr auto opaqueName     = std::string_view{".wh..wh..opq"};
+
+    /** e.g. "/usr/bin" -> "<dir>/usr/bin"
+     */
+    auto realPath(std::string_view path) const -> std::filesystem::path {
+        return dir / std::filesystem::path{path}.relative_path();
+    }
+
+    auto whiteoutPath(std::string_view path) const -> std::filesystem::path {
+        auto p = std::filesystem::path{path};
+        return realPath(path).parent_path() / (std::string{whiteoutPrefix} + p.filename().string());
+    }
+
+    static auto isInternal(std::string_view name) -> bool {
+        return name.starts_with(whiteoutPrefix);
+    }
+
+    /** true if the entry exists in the upper directory
+     */
+    auto contains(std::string_view path) const -> bool {
+        struct stat st;
+        return ::lstat(realPath(path).c_str(), &st) == 0;
+    }
+
+    /** true if lower layers must not be asked for this path
+     *
+     * That is the case if the path or one of its parent directories was deleted
+     * (whiteout), or if one of its parent directories is opaque.
+     */
+    auto hides(std::string_view path) const -> bool {
+        for (auto p = std::filesystem::path{path}; p.has_relative_path(); p = p.parent_path()) {
+            if (hasWhiteout(p.string()) || isOpaque(p.parent_path().string())) return true;
+        }
+        return false;
+    }
+
+    /** true if the entry at path was deleted, without looking at its parent directories
+     */
+    auto hasWhiteout(std::string_view path) const -> bool {
+        struct stat st;
+        return ::lstat(whiteoutPath(path).c_str(), &st) == 0;
+    }
+
+    /** hides the lower entry at path, the parent directory must exist in the upper directory
+     */
+    auto addWhiteout(std::string_view path) const -> int {
+        auto fd = ::open(whiteoutPath(path).c_str(), O_CREAT | O_WRONLY | O_CLOEXEC, 0600);
+        if (fd == -1) return -errno;
+        ::close(fd);
+        return 0;
+    }
+
+    /** removes the whiteout of path, returns true if there was one
+     */
+    auto removeWhiteout(std::string_view path) const -> bool {
+        return ::unlink(whiteoutPath(path).c_str()) == 0;
+    }
+
+    auto setOpaque(std::string_view path) const -> int {
+        auto fd = ::open((realPath(path) / opaqueName).c_str(), O_CREAT | O_WRONLY | O_CLOEXEC, 0600);
+        if (fd == -1) return -errno;
+        ::close(fd);
+        return 0;
+    }
+
+    auto isOpaque(std::string_view path) const -> bool {
+        struct stat st;
+        return ::lstat((realPath(path) / opaqueName).c_str(), &st) == 0;
+    }
+
+    /** removes the whiteouts and the opaque marker of a directory, before it is removed
+     */
+    void clearInternal(std::string_view path) const {
+        auto ec = std::error_code{};
+        for (auto const& e : std::filesystem::directory_iterator{realPath(path), ec}) {
+            if (isInternal(e.path().filename().string())) {
+                std::filesystem::remove(e.path(), ec);
+            }
+        }
+    }
+};
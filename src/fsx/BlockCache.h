@@ -0,0 +1,70 @@
+// SPDX-FileCopyrightText: 2023 S. G. Gottlieb <info.simon@gottliebtfreitag.de>
+// SPDX-License-Identifier: AGPL-3.0-only
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace fsx {
+
+/**
+ * Small cache of decompressed blocks
+ *
+ * Blocks are identified by a key (e.g. the file offset of the compressed frame),
+ * the least recently used block is replaced.
+ * The cache is thread safe, blocks stay valid as long as the returned pointer is held.
+ */
+struct BlockCache {
+    using Block = std::shared_ptr<std::vector<char> const>;
+
+    struct Slot {
+        uint64_t key{UINT64_MAX};
+        uint64_t lastUse{};
+        Block    data;
+    };
+    std::vector<Slot>           slots;
+    uint64_t                    useCounter{};
+    std::unique_ptr<std::mutex> mutex{std::make_unique<std::mutex>()};
+
+    BlockCache(size_t slotCount = 16)
+        : slots(slotCount)
+    {}
+
+    /** returns the block with `key`, if missing `load(std::vector<char>&)` is called to fill it
+     *
+     * Loading happens without holding the lock, so different blocks are loaded in parallel.
+     */
+    template <typename CB>
+    auto get(uint64_t key, CB const& load) -> Block {
+        {
+            auto lock = std::lock_guard{*mutex};
+            for (auto& slot : slots) {
+                if (slot.key == key) {
+                    slot.lastUse = ++useCounter;
+                    return slot.data;
+                }
+            }
+        }
+        auto data = std::make_shared<std::vector<char>>();
+        load(*data);
+
+        auto lock   = std::lock_guard{*mutex};
+        auto victim = &slots[0];
+        for (auto& slot : slots) {
+            if (slot.key == key) { // loaded by another thread in the meantime
+                victim = &slot;
+                break;
+            }
+            if (slot.lastUse < victim->lastUse) {
+                victim = &slot;
+            }
+        }
+        victim->key     = key;
+        victim->lastUse = ++useCounter;
+        victim->data    = std::move(data);
+        return victim->data;
+    }
+};
+}
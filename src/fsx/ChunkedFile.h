@@ -0,0 +1,156 @@
+// SPDX-FileCopyrightText: 2023 S. G. Gottlieb <info.simon@gottliebtfreitag.de>
+// SPDX-License-Identifier: AGPL-3.0-only
+#pragma once
+
+#include "File.h"
+#include "Hex.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace fsx {
+
+/**
+ * Leading bytes of a chunk manifest
+ *
+ * A chunk manifest describes a file as a sequence of content addressed chunks.
+ * It is followed by a uint64_t with the number of chunks and one ChunkRef per chunk.
+ */
+struct ChunkManifestHeader {
+    std::array<char, 6> magicBytes {'F', 'S', 'X', '-', 'C', 'M'};
+    char                major{1};
+    char                minor{0};
+
+    auto operator<=>(ChunkManifestHeader const&) const noexcept = default;
+};
+
+struct __attribute__((__packed__)) ChunkRef {
+    std::array<uint8_t, 32> hash; // sha256 of the chunk content
+    uint64_t                size;
+};
+
+/** path of a chunk inside a chunk directory, e.g. "chunks/ab/abcdef..."
+ */
+inline auto chunkPath(std::filesystem::path const& chunkDir, std::array<uint8_t, 32> const& hash) -> std::filesystem::path {
+    auto hex = toHex(hash);
+    return chunkDir / hex.substr(0, 2) / hex;
+}
+
+/** check if `path` is a chunk manifest instead of a regular file
+ */
+inline bool isChunkManifest(std::filesystem::path const& path) {
+    auto ifs    = std::ifstream{path, std::ios::binary};
+    auto header = ChunkManifestHeader{};
+    ifs.read(reinterpret_cast<char*>(&header), sizeof(header));
+    return ifs.gcount() == sizeof(header) && header.magicBytes == ChunkManifestHeader{}.magicBytes;
+}
+
+/**
+ * Random access to a file described by a chunk manifest
+ *
+ * The chunks are expected in the directory "chunks", next to the folder of the manifest.
+ * Recently read chunks stay opened, the least recently used one is closed.
+ * Reading is thread safe.
+ */
+struct ChunkedFile {
+    struct Slot {
+        size_t                      chunk{SIZE_MAX};
+        uint64_t                    lastUse{};
+        std::shared_ptr<File const> file;
+    };
+
+    std::filesystem::path chunkDir;
+    std::vector<ChunkRef> chunks;
+    std::vector<uint64_t> offsets; // offset of each chunk, last element is the total size
+
+    mutable std::vector<Slot>   openChunks = std::vector<Slot>(16); // see openChunk
+    mutable uint64_t            useCounter{};
+    std::unique_ptr<std::mutex> mutex{std::make_unique<std::mutex>()};
+
+    ChunkedFile(std::filesystem::path const& manifest)
+        : chunkDir{manifest.parent_path().parent_path() / "chunks"}
+    {
+        auto ifs    = std::ifstream{manifest, std::ios::binary};
+        auto header = ChunkManifestHeader{};
+        auto count  = uint64_t{};
+        ifs.read(reinterpret_cast<char*>(&header), sizeof(header));
+        ifs.read(reinterpret_cast<char*>(&count), sizeof(count));
+        if (!ifs.good() || header != ChunkManifestHeader{}) {
+            throw std::runtime_error{"unexpected chunk manifest header: " + manifest.string()};
+        }
+        chunks.resize(count);
+        ifs.read(reinterpret_cast<char*>(chunks.data()), count * sizeof(ChunkRef));
+        if (static_cast<size_t>(ifs.gcount()) != count * sizeof(ChunkRef)) {
+            throw std::runtime_error{"truncated chunk manifest: " + manifest.string()};
+        }
+        offsets.reserve(count + 1);
+        offsets.push_back(0);
+        for (auto const& c : chunks) {
+            offsets.push_back(offsets.back() + c.size);
+        }
+    }
+    ChunkedFile(ChunkedFile const&) = delete;
+    ChunkedFile(ChunkedFile&&) noexcept = default;
+
+    auto size() const -> uint64_t {
+        return offsets.back();
+    }
+
+    auto read(char* buf, size_t count, uint64_t offset) const -> size_t {
+        auto total = size_t{};
+        while (total < count && offset + total < size()) {
+            auto pos = offset + total;
+            auto idx = static_cast<size_t>(std::ranges::upper_bound(offsets, pos) - offsets.begin()) - 1;
+            auto chunk   = openChunk(idx);
+            auto inChunk = pos - offsets[idx];
+            auto ct      = std::min<uint64_t>(count - total, chunks[idx].size - inChunk);
+            if (chunk->read(buf + total, ct, inChunk) != ct) {
+                throw std::runtime_error{"truncated chunk " + chunkPath(chunkDir, chunks[idx].hash).string()};
+            }
+            total += ct;
+        }
+        return total;
+    }
+
+private:
+    /** opened file of a chunk, it stays valid as long as the returned pointer is held
+     */
+    auto openChunk(size_t idx) const -> std::shared_ptr<File const> {
+        {
+            auto lock = std::lock_guard{*mutex};
+            for (auto& slot : openChunks) {
+                if (slot.chunk == idx) {
+                    slot.lastUse = ++useCounter;
+                    return slot.file;
+                }
+            }
+        }
+        auto file = std::make_shared<File const>(chunkPath(chunkDir, chunks[idx].hash)); // opened without holding the lock
+
+        auto lock   = std::lock_guard{*mutex};
+        auto victim = &openChunks[0];
+        for (auto& slot : openChunks) {
+            if (slot.chunk == idx) { // opened by another thread in the meantime
+                victim = &slot;
+                break;
+            }
+            if (slot.lastUse < victim->lastUse) {
+                victim = &slot;
+            }
+        }
+        victim->chunk   = idx;
+        victim->lastUse = ++useCounter;
+        victim->file    = std::move(file);
+        return victim->file;
+    }
+};
+}
@@ -4,6 +4,14 @@
 #include <cstdint>
 
 namespace fsx {
+/**
+ * Attributes of a single entry
+ *
+ * type 0: regular file
+ *      1: directory
+ *      2: symlink, the content is the link target
+ *      3: regular file sharing the content of another file (hard link, only gar v1)
+ */
 struct __attribute__((__packed__)) EntryHeader {
     uint32_t uid;
     uint32_t gid;
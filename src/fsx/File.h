@@ -0,0 +1,71 @@
+// SPDX-FileCopyrightText: 2023 S. G. Gottlieb <info.simon@gottliebtfreitag.de>
+// SPDX-License-Identifier: AGPL-3.0-only
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+namespace fsx {
+
+/**
+ * Read only file descriptor
+ *
+ * All reads are positional (pread), so a single File can be used by multiple threads.
+ */
+struct File {
+    int fd{-1};
+
+    File() = default;
+    File(std::filesystem::path const& path) {
+        fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            throw std::runtime_error{"could not open file: " + path.string()};
+        }
+    }
+    File(File const&) = delete;
+    File(File&& oth) noexcept
+        : fd{std::exchange(oth.fd, -1)}
+    {}
+    ~File() {
+        if (fd != -1) {
+            ::close(fd);
+        }
+    }
+    auto operator=(File const&) -> File& = delete;
+    auto operator=(File&& oth) noexcept -> File& {
+        std::swap(fd, oth.fd);
+        return *this;
+    }
+
+    auto size() const -> uint64_t {
+        struct stat st{};
+        if (fstat(fd, &st) != 0) {
+            throw std::runtime_error{std::string{"could not stat file: "} + std::strerror(errno)};
+        }
+        return st.st_size;
+    }
+
+    /** reads up to `count` bytes at `offset`, less only at the end of the file
+     */
+    auto read(char* buf, size_t count, uint64_t offset) const -> size_t {
+        auto total = size_t{};
+        while (total < count) {
+            auto ct = ::pread(fd, buf + total, count - total, offset + total);
+            if (ct == 0) break;
+            if (ct == -1) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error{std::string{"could not read file: "} + std::strerror(errno)};
+            }
+            total += ct;
+        }
+        return total;
+    }
+};
+}
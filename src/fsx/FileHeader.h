@@ -5,9 +5,21 @@
 #include <array>
 
 namespace fsx {
+/**
+ * Leading bytes of every gar file.
+ *
+ * major 0: every entry is stored as EntryHeader + name + content, one after another
+ * major 1: only contents are stored in the front, followed by a table of contents and a Footer
+ *          minor 0: sorted table of contents referencing the children of each directory (TocEntry),
+ *                   compressed blocks, alignment and the Merkle tree are optional (see Footer),
+ *                   as are shared and inline contents (see TocEntry)
+ *
+ * A new minor version may only add optional features, files of earlier minor versions
+ * stay valid: a reader of 1.N reads every 1.M with M <= N.
+ */
 struct FileHeader {
     std::array<char, 6> magicBytes {'F', 'S', 'X', '-', 'A', 'R'};
-    char                major{0};
+    char                major{1};
     char                minor{0};
 
     auto operator<=>(FileHeader const&) const noexcept = default;
@@ -0,0 +1,27 @@
+// SPDX-FileCopyrightText: 2023 S. G. Gottlieb <info.simon@gottliebtfreitag.de>
+// SPDX-License-Identifier: AGPL-3.0-only
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+namespace fsx {
+/**
+ * Fixed size trailer of a gar v1 file.
+ *
+ * Always the last bytes of the archive, it points to the table of contents (toc),
+ * see TocEntry.
+ */
+struct __attribute__((__packed__)) Footer {
+    std::array<char, 8> magicBytes {'F', 'S', 'X', '-', 'T', 'O', 'C', '\0'};
+    uint64_t            tocOffset{};
+    uint64_t            tocSize{};
+    uint64_t            entryCount{};
+    uint64_t            blockCount{}; // number of compressed blocks, see TocEntry::blockBegin
+    uint32_t            blockSize{};  // uncompressed size of each compressed block
+    uint32_t            alignment{};  // uncompressed file contents start at a multiple of this (0: unaligned)
+    uint64_t            alignmentCutoff{}; // files smaller than this are not aligned
+    uint64_t            merkleOffset{};    // Merkle tree over [0, merkleOffset), see Merkle.h
+    uint32_t            merkleBlockSize{}; // size of the blocks hashed as leaves (0: no Merkle tree)
+};
+}
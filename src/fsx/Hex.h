@@ -0,0 +1,25 @@
+// SPDX-FileCopyrightText: 2023 S. G. Gottlieb <info.simon@gottliebtfreitag.de>
+// SPDX-License-Identifier: AGPL-3.0-only
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+
+namespace fsx {
+
+/** lower case hex digits of `bytes`, e.g. of a sha256 sum
+ */
+inline auto toHex(std::span<uint8_t const> bytes) -> std::string {
+    constexpr auto digits = std::string_view{"0123456789abcdef"};
+    auto hex = std::string{};
+    hex.reserve(bytes.size() * 2);
+    for (auto c : bytes) {
+        hex += digits[c >> 4];
+        hex += digits[c & 0x0f];
+    }
+    return hex;
+}
+
+}
@@ -0,0 +1,59 @@
+// SPDX-FileCopyrightText: 2023 S. G. Gottlieb <info.simon@gottliebtfreitag.de>
+// SPDX-License-Identifier: AGPL-3.0-only
+#pragma once
+
+#include <fcntl.h>
+#include <filesystem>
+#include <span>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <utility>
+
+namespace fsx {
+
+/**
+ * Read only memory mapping of a complete file
+ */
+struct MappedFile {
+    void*  data{nullptr};
+    size_t size{};
+
+    MappedFile() = default;
+    MappedFile(std::filesystem::path const& path) {
+        auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            throw std::runtime_error{"could not open file: " + path.string()};
+        }
+        size = std::filesystem::file_size(path);
+        if (size > 0) {
+            data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            data = nullptr;
+            throw std::runtime_error{"could not mmap file: " + path.string()};
+        }
+    }
+    MappedFile(MappedFile const&) = delete;
+    MappedFile(MappedFile&& oth) noexcept
+        : data{std::exchange(oth.data, nullptr)}
+        , size{std::exchange(oth.size, 0)}
+    {}
+    ~MappedFile() {
+        if (data) {
+            munmap(data, size);
+        }
+    }
+    auto operator=(MappedFile const&) -> MappedFile& = delete;
+    auto operator=(MappedFile&& oth) noexcept -> MappedFile& {
+        std::swap(data, oth.data);
+        std::swap(size, oth.size);
+        return *this;
+    }
+
+    auto span() const -> std::span<char const> {
+        return {reinterpret_cast<char const*>(data), size};
+    }
+};
+}
@@ -0,0 +1,143 @@
+// SPDX-FileCopyrightText: 2023 S. G. Gottlieb <info.simon@gottliebtfreitag.de>
+// SPDX-License-Identifier: AGPL-3.0-only
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+#include <openssl/evp.h>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace fsx {
+
+/**
+ * Merkle tree over fixed size blocks of a gar file
+ *
+ * The leaves are the sha256 sums of each `Footer::merkleBlockSize` block of the
+ * range [0, merkleOffset), which covers all file contents and the table of contents.
+ * Each further level hashes pairs of the level below (a remaining single node is
+ * hashed alone), until a single node is left. All levels are stored one after another,
+ * leaves first, so the top node is the last node.
+ * Leaves, inner nodes and the root are hashed with different prefixes, so one can not
+ * be passed off as another. The root (see merkleRoot) also covers the block size and
+ * the size of the range, it identifies a package.
+ */
+using Hash = std::array<uint8_t, 32>;
+
+/** sha256 of the concatenation of `parts`
+ */
+inline auto sha256(std::initializer_list<std::span<char const>> parts) -> Hash {
+    auto ctx = std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)>{EVP_MD_CTX_new(), &EVP_MD_CTX_free};
+    auto ok  = ctx && EVP_DigestInit_ex(ctx.get(), EVP_sha256(), nullptr);
+    for (auto const& part : parts) {
+        ok = ok && EVP_DigestUpdate(ctx.get(), part.data(), part.size());
+    }
+    auto hash = Hash{};
+    auto len  = unsigned{};
+    if (!ok || !EVP_DigestFinal_ex(ctx.get(), hash.data(), &len)) {
+        throw std::runtime_error{"error computing sha256"};
+    }
+    return hash;
+}
+
+constexpr char merkleLeafPrefix{0x00};
+constexpr char merkleNodePrefix{0x01};
+constexpr char merkleRootPrefix{0x02};
+
+inline auto merkleLeafHash(std::span<char const> block) -> Hash {
+    return sha256({{&merkleLeafPrefix, 1}, block});
+}
+
+/** hash of one or two child nodes
+ */
+inline auto merkleNodeHash(std::span<Hash const> children) -> Hash {
+    return sha256({{&merkleNodePrefix, 1}, {reinterpret_cast<char const*>(children.data()), children.size_bytes()}});
+}
+
+/** root identifying the tree, binds its top node to the block size and the hashed range
+ */
+inline auto merkleRoot(Hash const& top, uint32_t blockSize, uint64_t size) -> Hash {
+    auto leafCount = (size + blockSize - 1) / blockSize;
+    return sha256({{&merkleRootPrefix, 1},
+                   {reinterpret_cast<char const*>(&blockSize), sizeof(blockSize)},
+                   {reinterpret_cast<char const*>(&size), sizeof(size)},
+                   {reinterpret_cast<char const*>(&leafCount), sizeof(leafCount)},
+                   {reinterpret_cast<char const*>(top.data()), top.size()}});
+}
+
+inline auto fromHex(std::string_view hex) -> Hash {
+    auto digit = [&](char c) -> uint8_t {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        throw std::runtime_error{"invalid hash " + std::string{hex}};
+    };
+    auto hash = Hash{};
+    if (hex.size() != hash.size() * 2) {
+        throw std::runtime_error{"invalid hash " + std::string{hex}};
+    }
+    for (size_t i{0}; i < hash.size(); ++i) {
+        hash[i] = (digit(hex[i*2]) << 4) | digit(hex[i*2+1]);
+    }
+    return hash;
+}
+
+inline auto merkleLeafCount(uint64_t size, uint32_t blockSize) -> uint64_t {
+    return (size + blockSize - 1) / blockSize;
+}
+
+/** number of nodes of all levels, given the number of leaves
+ */
+inline auto merkleNodeCount(uint64_t leafCount) -> uint64_t {
+    auto total = leafCount;
+    while (leafCount > 1) {
+        leafCount = (leafCount + 1) / 2;
+        total += leafCount;
+    }
+    return total;
+}
+
+/** computes all levels above the leaves, `nodes` must start with the leaves
+ */
+inline void merkleBuildLevels(std::vector<Hash>& nodes, uint64_t leafCount) {
+    nodes.resize(merkleNodeCount(leafCount));
+    auto levelBegin = uint64_t{0};
+    auto levelSize  = leafCount;
+    auto out        = leafCount;
+    while (levelSize > 1) {
+        for (uint64_t i{0}; i < levelSize; i += 2) {
+            auto ct = std::min<uint64_t>(2, levelSize - i);
+            nodes[out++] = merkleNodeHash({&nodes[levelBegin + i], ct});
+        }
+        levelBegin += levelSize;
+        levelSize   = (levelSize + 1) / 2;
+    }
+}
+
+/** hashes all blocks of `data` in parallel and computes the complete tree
+ */
+inline auto computeMerkleTree(std::span<char const> data, uint32_t blockSize, size_t threadCount) -> std::vector<Hash> {
+    auto leafCount = merkleLeafCount(data.size(), blockSize);
+    auto nodes     = std::vector<Hash>(leafCount);
+    auto next      = std::atomic<uint64_t>{0};
+    {
+        auto workers = std::vector<std::jthread>{};
+        for (size_t t{0}; t < std::max<size_t>(1, threadCount); ++t) {
+            workers.emplace_back([&]() {
+                for (auto i = next++; i < leafCount; i = next++) {
+                    nodes[i] = merkleLeafHash(data.subspan(i * blockSize, std::min<uint64_t>(blockSize, data.size() - i * blockSize)));
+                }
+            });
+        }
+    }
+    merkleBuildLevels(nodes, leafCount);
+    return nodes;
+}
+}
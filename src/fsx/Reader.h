@@ -2,67 +2,379 @@
 // SPDX-License-Identifier: AGPL-3.0-only
 #pragma once
 
+#include "BlockCache.h"
+#include "ChunkedFile.h"
+#include "File.h"
 #include "FileHeader.h"
 #include "EntryHeader.h"
+#include "Footer.h"
+#include "MappedFile.h"
+#include "Merkle.h"
+#include "Toc.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fcntl.h>
 #include <filesystem>
-#include <fstream>
+#include <linux/fs.h>
 #include <optional>
 #include <span>
 #include <stdexcept>
+#include <string>
+#include <sys/ioctl.h>
+#include <unistd.h>
 #include <vector>
+#include <zstd.h>
 
 namespace fsx {
 
+/**
+ * Reads a gar file
+ *
+ * The gar file is either a regular file or described by a chunk manifest (see ChunkedFile).
+ * After construction all reads are thread safe.
+ */
 struct Reader {
-    std::ifstream ifs;
+    std::filesystem::path      path;
+    File                       file;
+    std::optional<ChunkedFile> chunks;
+    uint64_t                   fileSize{};
+    FileHeader                 header;
+    Footer                     footer; // only gar v1
+
+    MappedFile        mapping;   // complete file (only gar v1, not chunked)
+    std::vector<char> tocBuffer; // table of contents if it is not mapped
+    TocView           toc;
+    BlockCache        cache;     // recently decompressed blocks
+
+    std::span<Hash const> merkle;        // all nodes of the Merkle tree, leaves first (if available)
+    std::vector<Hash>     merkleBuffer;  // Merkle tree if it is not mapped
+    bool                  verify{false}; // check blocks against the Merkle tree on first read
+    std::vector<std::atomic<uint64_t>> verified; // bitmap of blocks that have already been verified
 
     Reader(std::filesystem::path path_)
-        : ifs{path_, std::ios::binary}
+        : path{path_}
     {
-        if (!ifs.good()) {
-            throw std::runtime_error{"could not open file: " + path_.string()};
+        if (isChunkManifest(path_)) {
+            chunks.emplace(path_);
+            fileSize = chunks->size();
+        } else {
+            file     = File{path_};
+            fileSize = file.size();
         }
         auto defaultFileHeader = fsx::FileHeader{};
-        auto header = readPOD<fsx::FileHeader>();
-        if (header != defaultFileHeader) {
+        header = readPOD<fsx::FileHeader>(0);
+        if (header.magicBytes != defaultFileHeader.magicBytes) {
             throw std::runtime_error{"unexpected header"};
         }
+        if (header.major == defaultFileHeader.major && header.minor <= defaultFileHeader.minor) {
+            if (!chunks) {
+                mapping = MappedFile{path_};
+            }
+            loadToc();
+        } else if (header.major == 0) {
+            scanLegacy();
+        } else {
+            throw std::runtime_error{"unsupported gar version " + std::to_string(header.major) + "." + std::to_string(header.minor)};
+        }
     }
     Reader(Reader const&) = delete;
     Reader(Reader&&) noexcept = default;
 
-    struct Entry {
-        EntryHeader header;
-        std::string name;
-        size_t      file_offset;
+    /** references the table of contents of a gar v1 file inside the mapping or loads it with a single read
+     */
+    void loadToc() {
+        if (fileSize < sizeof(FileHeader) + sizeof(Footer)) {
+            throw std::runtime_error{"gar file is missing its table of contents"};
+        }
+        footer = readPOD<Footer>(fileSize - sizeof(Footer));
+        if (footer.magicBytes != Footer{}.magicBytes
+            || footer.tocOffset > fileSize - sizeof(footer)
+            || footer.tocSize > fileSize - sizeof(footer) - footer.tocOffset) {
+            throw std::runtime_error{"gar file is missing its table of contents"};
+        }
+        if (mapping.data) {
+            toc = TocView{mapping.span().subspan(footer.tocOffset, footer.tocSize), footer};
+        } else {
+            tocBuffer.resize(footer.tocSize);
+            if (readContent(tocBuffer.data(), tocBuffer.size(), footer.tocOffset) != tocBuffer.size()) {
+                throw std::runtime_error{"gar file has a truncated table of contents"};
+            }
+            toc = TocView{tocBuffer, footer};
+        }
+        // a Merkle tree has a block size and covers at least everything up to the end of the table of contents
+        if ((footer.merkleBlockSize == 0) != (footer.merkleOffset == 0)
+            || (footer.merkleBlockSize > 0 && footer.merkleOffset < footer.tocOffset + footer.tocSize)) {
+            throw std::runtime_error{"gar file has a corrupted Merkle tree"};
+        }
+        if (footer.merkleBlockSize > 0) {
+            loadMerkleTree();
+        }
+    }
 
-    };
-    auto readNext() -> std::optional<Entry> {
-        auto entry = Entry{};
-        ifs.read(reinterpret_cast<char*>(&entry.header), sizeof(entry.header));
-        if (ifs.gcount() != sizeof(entry.header)) return std::nullopt;
+    void loadMerkleTree() {
+        auto nodeCount = merkleNodeCount(merkleLeafCount(footer.merkleOffset, footer.merkleBlockSize));
+        if (footer.merkleOffset > fileSize - sizeof(Footer)
+            || nodeCount > (fileSize - sizeof(Footer) - footer.merkleOffset) / sizeof(Hash)) {
+            throw std::runtime_error{"gar file has a corrupted Merkle tree"};
+        }
+        if (mapping.data) {
+            merkle = {reinterpret_cast<Hash const*>(mapping.span().data() + footer.merkleOffset), nodeCount};
+            return;
+        }
+        merkleBuffer.resize(nodeCount);
+        auto size = nodeCount * sizeof(Hash);
+        if (readContent(reinterpret_cast<char*>(merkleBuffer.data()), size, footer.merkleOffset) != size) {
+            throw std::runtime_error{"gar file has a corrupted Merkle tree"};
+        }
+        merkle = merkleBuffer;
+    }
+
+    /** root of the stored Merkle tree, see fsx::merkleRoot
+     */
+    auto merkleRoot() const -> std::optional<Hash> {
+        if (merkle.empty()) return std::nullopt;
+        return fsx::merkleRoot(merkle.back(), footer.merkleBlockSize, footer.merkleOffset);
+    }
+
+    /** recomputes the root of the Merkle tree from the file contents, using multiple threads
+     */
+    auto computeMerkleRoot(size_t threadCount) const -> Hash {
+        if (merkle.empty() || !mapping.data) {
+            throw std::runtime_error{"gar file has no Merkle tree"};
+        }
+        auto top = computeMerkleTree(mapping.span().subspan(0, footer.merkleOffset), footer.merkleBlockSize, threadCount).back();
+        return fsx::merkleRoot(top, footer.merkleBlockSize, footer.merkleOffset);
+    }
+
+    /** checks every block against the Merkle tree when it is read for the first time
+     *
+     * The tree itself is checked right away and must match `expectedRoot` (if given).
+     * The table of contents is verified immediately, since it is used by every lookup.
+     */
+    void enableVerification(std::optional<Hash> expectedRoot) {
+        if (merkle.empty()) {
+            throw std::runtime_error{"gar file has no Merkle tree"};
+        }
+        auto leafCount = merkleLeafCount(footer.merkleOffset, footer.merkleBlockSize);
+        auto nodes     = std::vector<Hash>(merkle.begin(), merkle.begin() + leafCount);
+        merkleBuildLevels(nodes, leafCount);
+        if (!std::ranges::equal(nodes, merkle)) {
+            throw std::runtime_error{"gar file has a corrupted Merkle tree"};
+        }
+        if (expectedRoot && *expectedRoot != merkleRoot()) {
+            throw std::runtime_error{"gar file does not match the expected Merkle root"};
+        }
+        verified = std::vector<std::atomic<uint64_t>>((leafCount + 63) / 64);
+        verify = true;
+        verifyRange(footer.tocOffset, footer.tocSize);
+    }
+
+    /** verifies all not yet verified blocks of the range [offset, offset+size)
+     */
+    void verifyRange(uint64_t offset, uint64_t size) {
+        if (!verify || size == 0) return;
+        auto blockSize = footer.merkleBlockSize;
+        auto leafCount = merkleLeafCount(footer.merkleOffset, blockSize);
+        for (auto i = offset / blockSize; i <= (offset + size - 1) / blockSize && i < leafCount; ++i) {
+            auto bit = uint64_t{1} << (i % 64);
+            if (verified[i / 64].load(std::memory_order_relaxed) & bit) continue;
+            auto begin = i * blockSize;
+            auto len   = std::min<uint64_t>(blockSize, footer.merkleOffset - begin);
+            auto hash  = [&]() {
+                if (mapping.data) return merkleLeafHash(mapping.span().subspan(begin, len));
+                auto buffer = std::vector<char>(len);
+                buffer.resize(readContent(buffer.data(), buffer.size(), begin));
+                return merkleLeafHash(buffer);
+            }();
+            if (hash != merkle[i]) {
+                throw std::runtime_error{"gar file is corrupted, block " + std::to_string(i) + " does not match the Merkle tree"};
+            }
+            verified[i / 64].fetch_or(bit, std::memory_order_relaxed);
+        }
+    }
+
+    /** builds a table of contents for gar v0 files by walking over every entry
+     */
+    void scanLegacy() {
+        auto builder = TocBuilder{};
+        auto pos     = uint64_t{sizeof(FileHeader)};
+        for (auto entry = readNext(pos); entry; entry = readNext(pos)) {
+            builder.entries.emplace_back(std::move(*entry));
+        }
+        tocBuffer = builder.build(footer);
+        toc = TocView{tocBuffer, footer};
+    }
+
+    /** reads the gar v0 entry at `pos` and moves `pos` to the next entry
+     */
+    auto readNext(uint64_t& pos) -> std::optional<TocBuilder::Entry> {
+        auto entry = TocBuilder::Entry{};
+        if (readContent(reinterpret_cast<char*>(&entry.header), sizeof(entry.header), pos) != sizeof(entry.header)) return std::nullopt;
+        pos += sizeof(entry.header);
 
         entry.name.resize(entry.header.name_size);
-        ifs.read(entry.name.data(), entry.header.name_size);
-        if (ifs.gcount() != entry.header.name_size) return std::nullopt;
-        entry.file_offset = ifs.tellg();
-        ifs.seekg((uint64_t)ifs.tellg() + entry.header.size); //!TODO tellg could be negative
+        if (readContent(entry.name.data(), entry.header.name_size, pos) != entry.header.name_size) return std::nullopt;
+        pos += entry.header.name_size;
+        entry.file_offset = pos;
+        pos += entry.header.size;
         return entry;
     }
 
+    /** reads the content of a file entry, compressed blocks are decompressed on the fly
+     */
+    auto read(TocEntry const& e, char* buf, size_t count, size_t offset) -> size_t {
+        if (offset >= e.header.size) return 0;
+        count = std::min<size_t>(count, e.header.size - offset);
+        if (!(e.flags & TocEntry::Compressed)) {
+            if (!(e.flags & TocEntry::Inline)) {
+                verifyRange(e.fileOffset + offset, count);
+            }
+            if (auto data = payload(e); !data.empty()) {
+                std::memcpy(buf, data.data() + offset, count);
+                return count;
+            }
+            return readContent(buf, count, e.fileOffset + offset);
+        }
+
+        toc.blockCount(e); // rejects a corrupted block table (e.g. block size 0)
+        auto total = size_t{};
+        while (total < count) {
+            auto pos     = offset + total;
+            auto idx     = pos / toc.blockSize;
+            auto block   = readBlock(e, idx);
+            auto inBlock = pos - idx * toc.blockSize;
+            if (inBlock >= block->size()) break;
+            auto ct = std::min(count - total, block->size() - inBlock);
+            std::memcpy(buf + total, block->data() + inBlock, ct);
+            total += ct;
+        }
+        return total;
+    }
+
+    /** position of (a part of) an uncompressed entry inside the gar file
+     */
+    struct FileRange {
+        int      fd;
+        uint64_t offset;
+        size_t   size;
+    };
+
+    /** where `count` bytes at `offset` of an entry are stored, so they can be passed on by file descriptor
+     *
+     * Returns std::nullopt if the content is not stored as is (compressed, inline or chunked gar file).
+     */
+    auto fileRange(TocEntry const& e, size_t count, size_t offset) -> std::optional<FileRange> {
+        if (chunks || (e.flags & (TocEntry::Compressed | TocEntry::Inline))) return std::nullopt;
+        if (offset >= e.header.size) return FileRange{file.fd, e.fileOffset, 0};
+        count = std::min<size_t>(count, e.header.size - offset);
+        verifyRange(e.fileOffset + offset, count);
+        return FileRange{file.fd, e.fileOffset + offset, count};
+    }
+
+    /** starts loading a range of an entry into memory, to make later reads fast
+     *
+     * Uncompressed contents are read ahead by the kernel in the background (posix_fadvise),
+     * compressed contents are decompressed into the block cache right away.
+     */
+    void prefetch(TocEntry const& e, uint64_t offset, uint64_t size) {
+        if ((e.flags & TocEntry::Inline) || offset >= e.header.size) return;
+        size = std::min(size, e.header.size - offset);
+        if (!chunks && !(e.flags & TocEntry::Compressed)) {
+            ::posix_fadvise(file.fd, e.fileOffset + offset, size, POSIX_FADV_WILLNEED);
+            return;
+        }
+        auto buffer = std::vector<char>(std::min<uint64_t>(size, toc.blockSize > 0 ? toc.blockSize : 65536));
+        for (auto pos = offset; pos < offset + size; pos += buffer.size()) {
+            read(e, buffer.data(), std::min<uint64_t>(buffer.size(), offset + size - pos), pos);
+        }
+    }
+
+    /** anonymous file with the content of an uncompressed entry, sharing the blocks of the gar file
+     *
+     * Only possible for aligned entries (see Footer::alignment) on file systems with
+     * reflinks (e.g. btrfs, xfs), nothing is copied. Returns a File without a
+     * file descriptor otherwise.
+     */
+    auto cloneContent(TocEntry const& e) -> File {
+        auto clone = File{};
+        auto const& h = e.header;
+        if (chunks || (e.flags & (TocEntry::Compressed | TocEntry::Inline)) || h.size == 0
+            || footer.alignment == 0 || e.fileOffset % footer.alignment != 0 || e.fileOffset >= fileSize) {
+            return clone;
+        }
+        verifyRange(e.fileOffset, h.size);
+        clone.fd = ::open(path.parent_path().c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (clone.fd == -1) return clone;
+
+        // the cloned range must be aligned, except if it ends at the end of the gar file
+        auto alignedSize = (h.size + footer.alignment - 1) / footer.alignment * footer.alignment;
+        auto range = file_clone_range {
+            .src_fd      = file.fd,
+            .src_offset  = e.fileOffset,
+            .src_length  = std::min<uint64_t>(alignedSize, fileSize - e.fileOffset),
+            .dest_offset = 0,
+        };
+        if (::ioctl(clone.fd, FICLONERANGE, &range) != 0 || ::ftruncate(clone.fd, h.size) != 0) {
+            return File{};
+        }
+        return clone;
+    }
+
+    /** content of an uncompressed entry directly inside the mapping or the table of contents
+     *
+     * Returns an empty span if the file is not mapped or the entry is compressed.
+     * If the archive is aligned (see Footer::alignment) large files start at page boundaries.
+     */
+    auto payload(TocEntry const& e) const -> std::span<char const> {
+        if (e.flags & TocEntry::Inline) return toc.inlineContent(e);
+        if (!mapping.data || (e.flags & TocEntry::Compressed)) return {};
+        auto file = mapping.span();
+        if (e.fileOffset > file.size() || e.header.size > file.size() - e.fileOffset) {
+            throw std::runtime_error{"gar file has a corrupted entry"};
+        }
+        return file.subspan(e.fileOffset, e.header.size);
+    }
+
+    /** returns the i-th decompressed block of an entry
+     */
+    auto readBlock(TocEntry const& e, size_t i) -> BlockCache::Block {
+        auto [begin, end] = toc.blockRange(e, i);
+        return cache.get(begin, [&](std::vector<char>& data) {
+            if (begin > end || end > fileSize) {
+                throw std::runtime_error{"gar file has a corrupted block table"};
+            }
+            verifyRange(begin, end - begin);
+            auto frame = std::span<char const>{};
+            auto frameBuffer = std::vector<char>{};
+            if (mapping.data) {
+                frame = mapping.span().subspan(begin, end - begin);
+            } else {
+                frameBuffer.resize(end - begin);
+                frameBuffer.resize(readContent(frameBuffer.data(), frameBuffer.size(), begin));
+                frame = frameBuffer;
+            }
+            data.resize(toc.blockSize);
+            auto ct = ZSTD_decompress(data.data(), data.size(), frame.data(), frame.size());
+            if (ZSTD_isError(ct)) {
+                throw std::runtime_error{std::string{"failed decompressing block: "} + ZSTD_getErrorName(ct)};
+            }
+            data.resize(ct);
+        });
+    }
+
     auto readContent(char* buf, size_t count, size_t offset) -> size_t {
-        ifs.clear();
-        ifs.seekg(offset);
-        ifs.read(buf, count);
-        size_t ct = ifs.gcount();
-        return ct;
+        if (chunks) {
+            return chunks->read(buf, count, offset);
+        }
+        return file.read(buf, count, offset);
     }
 
     template <typename T>
-    auto readPOD() -> T {
-        T t;
-        ifs.read(reinterpret_cast<char*>(&t), sizeof(t));
+    auto readPOD(size_t offset) -> T {
+        T t{};
+        readContent(reinterpret_cast<char*>(&t), sizeof(t), offset);
         return t;
     }
 };
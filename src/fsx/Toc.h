@@ -0,0 +1,296 @@
+// SPDX-FileCopyrightText: 2023 S. G. Gottlieb <info.simon@gottliebtfreitag.de>
+// SPDX-License-Identifier: AGPL-3.0-only
+#pragma once
+
+#include "EntryHeader.h"
+#include "Footer.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+namespace fsx {
+
+/**
+ * A single record of the table of contents
+ *
+ * The table of contents consists of `entryCount` records sorted by parent directory
+ * and then by file name, followed by the block table and a pool with all names.
+ * This way all children of a directory are a continuous range, which is referenced
+ * by the directory entry via `childBegin` and `childCount`. `nameOffset` is relative
+ * to the start of the table.
+ *
+ * Files with the `Compressed` flag are stored as a sequence of zstd frames, each frame holds
+ * `Footer::blockSize` bytes of the file. The block table holds the end offset of every
+ * frame, starting at index `blockBegin`. The first frame starts at `fileOffset`.
+ *
+ * Entries with the `Inline` flag (small files and symlinks) store their content in the
+ * pool, right after their name. `fileOffset` is then relative to the start of the table.
+ *
+ * Entries of type 3 reference the same content (fileOffset, flags and blocks) as
+ * the regular file they were deduplicated against. `linkCount` is the number of entries
+ * sharing this content.
+ */
+struct __attribute__((__packed__)) TocEntry {
+    enum Flags : uint8_t {
+        Compressed = 1,
+        Inline     = 2,
+    };
+
+    EntryHeader header;
+    uint64_t    nameOffset;
+    uint64_t    fileOffset;
+    uint32_t    childBegin;
+    uint32_t    childCount;
+    uint8_t     flags;
+    uint32_t    blockBegin;
+    uint32_t    linkCount;
+};
+
+/** splits "a/b/c" into "a/b" and "c"
+ */
+inline auto splitName(std::string_view name) -> std::tuple<std::string_view, std::string_view> {
+    auto pos = name.rfind('/');
+    if (pos == std::string_view::npos) return {std::string_view{}, name};
+    return {name.substr(0, pos), name.substr(pos+1)};
+}
+
+/** compares `name` against the concatenation of `a` and `b`, without building it
+ */
+inline int compareJoined(std::string_view name, std::string_view a, std::string_view b) {
+    if (auto c = name.substr(0, a.size()).compare(a); c != 0) return c;
+    return name.substr(a.size()).compare(b);
+}
+
+/**
+ * Collects entries and serializes them into a sorted table of contents
+ */
+struct TocBuilder {
+    struct Entry {
+        EntryHeader           header;
+        std::string           name;
+        uint64_t              file_offset;
+        uint8_t               flags{};
+        std::vector<uint64_t> blockEnds{};
+        std::string           content{}; // only for entries with TocEntry::Inline
+    };
+    std::vector<Entry> entries;
+
+    void add(EntryHeader const& header, std::string name, uint64_t file_offset, uint8_t flags = 0, std::vector<uint64_t> blockEnds = {}) {
+        entries.emplace_back(header, std::move(name), file_offset, flags, std::move(blockEnds));
+    }
+
+    /** adds an entry which content is stored inside the table of contents
+     */
+    void addInline(EntryHeader const& header, std::string name, std::string content) {
+        entries.emplace_back(header, std::move(name), 0, TocEntry::Inline, std::vector<uint64_t>{}, std::move(content));
+    }
+
+    /** serializes the table of contents, `footer` receives the entry and block count
+     */
+    auto build(Footer& footer) -> std::vector<char> {
+        std::ranges::sort(entries, {}, [](Entry const& e) { return splitName(e.name); });
+
+        // directories reference their children, which are sorted next to each other
+        auto dirs = std::unordered_map<std::string_view, size_t>{};
+        for (size_t i{0}; i < entries.size(); ++i) {
+            if (entries[i].header.type == 1) {
+                dirs[entries[i].name] = i;
+            }
+        }
+        auto children = std::vector<std::tuple<uint32_t, uint32_t>>(entries.size());
+        for (size_t i{0}; i < entries.size(); ++i) {
+            auto iter = dirs.find(std::get<0>(splitName(entries[i].name)));
+            if (iter == dirs.end()) continue;
+            auto& [begin, count] = children[iter->second];
+            if (count == 0) begin = i;
+            count += 1;
+        }
+
+        // count entries sharing their content
+        auto links = std::unordered_map<uint64_t, uint32_t>{};
+        for (auto const& e : entries) {
+            if (e.header.type == 3 && !(e.flags & TocEntry::Inline)) links[e.file_offset] += 1;
+        }
+        auto linkCount = [&](Entry const& e) -> uint32_t {
+            if (e.header.type != 3 && (e.header.type != 0 || e.header.size == 0)) return 1;
+            if (e.flags & TocEntry::Inline) return 1;
+            auto iter = links.find(e.file_offset);
+            if (iter == links.end()) return 1;
+            return iter->second + 1;
+        };
+
+        auto blockCount = size_t{};
+        auto poolSize   = size_t{};
+        for (auto const& e : entries) {
+            blockCount += e.blockEnds.size();
+            poolSize   += e.name.size() + e.content.size();
+        }
+        auto blockOffset = entries.size() * sizeof(TocEntry);
+        auto poolOffset  = blockOffset + blockCount * sizeof(uint64_t);
+
+        auto toc = std::vector<char>(poolOffset + poolSize);
+        auto record = reinterpret_cast<TocEntry*>(toc.data());
+        auto blocks = toc.data() + blockOffset;
+        auto pool   = toc.data() + poolOffset;
+        for (size_t i{0}; i < entries.size(); ++i) {
+            auto const& e = entries[i];
+            auto r = TocEntry {
+                .header     = e.header,
+                .nameOffset = static_cast<uint64_t>(pool - toc.data()),
+                .fileOffset = (e.flags & TocEntry::Inline) ? static_cast<uint64_t>(pool - toc.data()) + e.name.size() : e.file_offset,
+                .childBegin = std::get<0>(children[i]),
+                .childCount = std::get<1>(children[i]),
+                .flags      = e.flags,
+                .blockBegin = static_cast<uint32_t>((blocks - toc.data() - blockOffset) / sizeof(uint64_t)),
+                .linkCount  = linkCount(e),
+            };
+            r.header.name_size = e.name.size();
+            std::memcpy(record++, &r, sizeof(r));
+            std::memcpy(blocks, e.blockEnds.data(), e.blockEnds.size() * sizeof(uint64_t));
+            blocks += e.blockEnds.size() * sizeof(uint64_t);
+            std::memcpy(pool, e.name.data(), e.name.size());
+            pool += e.name.size();
+            std::memcpy(pool, e.content.data(), e.content.size());
+            pool += e.content.size();
+        }
+        footer.entryCount = entries.size();
+        footer.blockCount = blockCount;
+        return toc;
+    }
+};
+
+/**
+ * Read only view onto a serialized table of contents
+ *
+ * Lookups are binary searches directly on the serialized data,
+ * no per entry objects are created.
+ */
+struct TocView {
+    std::span<char const>     data;
+    std::span<TocEntry const> entries;
+    std::span<char const>     blocks;
+    size_t                    blockSize{};
+
+    TocView() = default;
+    TocView(std::span<char const> _data, Footer const& footer)
+        : data{_data}
+        , blockSize{footer.blockSize}
+    {
+        if (footer.entryCount > data.size() / sizeof(TocEntry)
+            || footer.blockCount > (data.size() - footer.entryCount * sizeof(TocEntry)) / sizeof(uint64_t)
+            || (footer.blockCount > 0 && footer.blockSize == 0)) {
+            throw std::runtime_error{"gar file has a corrupted table of contents"};
+        }
+        entries = {reinterpret_cast<TocEntry const*>(data.data()), footer.entryCount};
+        blocks  = data.subspan(footer.entryCount * sizeof(TocEntry), footer.blockCount * sizeof(uint64_t));
+    }
+
+    auto name(TocEntry const& e) const -> std::string_view {
+        if (e.nameOffset > data.size() || e.header.name_size > data.size() - e.nameOffset) {
+            throw std::runtime_error{"gar file has a corrupted table of contents"};
+        }
+        return {data.data() + e.nameOffset, e.header.name_size};
+    }
+
+    /** content of an entry with the TocEntry::Inline flag
+     */
+    auto inlineContent(TocEntry const& e) const -> std::span<char const> {
+        if (e.fileOffset > data.size() || e.header.size > data.size() - e.fileOffset) {
+            throw std::runtime_error{"gar file has a corrupted table of contents"};
+        }
+        return data.subspan(e.fileOffset, e.header.size);
+    }
+
+    /** last part of the entry name, e.g. "c" for "a/b/c"
+     */
+    auto baseName(TocEntry const& e) const -> std::string_view {
+        return std::get<1>(splitName(name(e)));
+    }
+
+    /** number of compressed blocks of an entry with the TocEntry::Compressed flag
+     */
+    auto blockCount(TocEntry const& e) const -> size_t {
+        auto total = blocks.size() / sizeof(uint64_t);
+        if (blockSize == 0) {
+            throw std::runtime_error{"gar file has a corrupted table of contents"};
+        }
+        auto count = e.header.size / blockSize + (e.header.size % blockSize != 0);
+        if (count > total || e.blockBegin > total - count) {
+            throw std::runtime_error{"gar file has a corrupted table of contents"};
+        }
+        return count;
+    }
+
+    /** file range of the i-th compressed block of an entry
+     */
+    auto blockRange(TocEntry const& e, size_t i) const -> std::tuple<uint64_t, uint64_t> {
+        auto blockEnd = [&](size_t idx) {
+            if (idx >= blocks.size() / sizeof(uint64_t)) {
+                throw std::runtime_error{"gar file has a corrupted table of contents"};
+            }
+            auto v = uint64_t{};
+            std::memcpy(&v, blocks.data() + idx * sizeof(uint64_t), sizeof(v));
+            return v;
+        };
+        auto begin = (i == 0) ? e.fileOffset : blockEnd(e.blockBegin + i - 1);
+        auto end   = blockEnd(e.blockBegin + i);
+        return {begin, end};
+    }
+
+    /** all children of a directory entry
+     */
+    auto children(TocEntry const& e) const -> std::span<TocEntry const> {
+        if (e.childBegin > entries.size() || e.childCount > entries.size() - e.childBegin) {
+            throw std::runtime_error{"gar file has a corrupted table of contents"};
+        }
+        return entries.subspan(e.childBegin, e.childCount);
+    }
+
+    /** finds the child with name `base` of a directory entry
+     */
+    auto findChild(TocEntry const& dir, std::string_view base) const -> TocEntry const* {
+        auto range = children(dir);
+        auto iter  = std::ranges::partition_point(range, [&](TocEntry const& e) {
+            return baseName(e) < base;
+        });
+        if (iter == range.end() || baseName(*iter) != base) return nullptr;
+        return &*iter;
+    }
+
+    /** index of an entry, e.g. to derive an inode number
+     */
+    auto index(TocEntry const& e) const -> size_t {
+        return &e - entries.data();
+    }
+
+    /** finds entry with parent directory `parentA` + `parentB` and name `base`
+     */
+    auto find(std::string_view parentA, std::string_view parentB, std::string_view base) const -> TocEntry const* {
+        auto compare = [&](TocEntry const& e) {
+            auto [parent, b] = splitName(name(e));
+            if (auto c = compareJoined(parent, parentA, parentB); c != 0) return c;
+            return b.compare(base);
+        };
+        auto iter = std::ranges::partition_point(entries, [&](TocEntry const& e) {
+            return compare(e) < 0;
+        });
+        if (iter == entries.end() || compare(*iter) != 0) return nullptr;
+        return &*iter;
+    }
+
+    /** finds entry with full name, e.g. "a/b/c"
+     */
+    auto find(std::string_view name) const -> TocEntry const* {
+        auto [parent, base] = splitName(name);
+        return find(parent, {}, base);
+    }
+};
+}
@@ -4,29 +4,76 @@
 
 #include "FileHeader.h"
 #include "EntryHeader.h"
+#include "Footer.h"
+#include "MappedFile.h"
+#include "Merkle.h"
+#include "Toc.h"
 
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <span>
 #include <stdexcept>
+#include <thread>
+#include <string>
+#include <string_view>
 #include <sys/stat.h>
+#include <unordered_map>
 #include <vector>
+#include <zstd.h>
 
 namespace fsx {
 
 struct Writer {
-    std::ofstream ofs;
+    std::filesystem::path path;
+    std::ofstream         ofs;
+
+    // table of contents, written on close
+    TocBuilder tocBuilder;
+
+    int      compressionLevel{0};        // zstd level for file contents, 0 means uncompressed
+    uint32_t blockSize{128 * 1024};      // uncompressed size of each independently compressed block
+    uint32_t alignment{0};               // uncompressed file contents start at a multiple of this, e.g. 4096 (0: unaligned)
+    uint64_t alignmentCutoff{16 * 1024}; // files smaller than this are not aligned
+    uint64_t inlineCutoff{512};          // files and symlinks up to this size are stored inside the table of contents
+    bool     deduplicate{true};          // identical files share their content, see EntryHeader type 3
+    uint32_t merkleBlockSize{64 * 1024}; // block size of the Merkle tree leaves (0: no Merkle tree)
+
+    // already written file contents, by hash of the content
+    struct Content {
+        std::filesystem::path path;
+        uint64_t              offset;
+        uint8_t               flags;
+        std::vector<uint64_t> blockEnds;
+    };
+    std::unordered_map<uint64_t, std::vector<Content>> contents;
 
     Writer(std::filesystem::path path_)
-        : ofs{path_, std::ios::binary}
+        : path{path_}
+        , ofs{path_, std::ios::binary}
     {
         auto defaultFileHeader = fsx::FileHeader{};
         addPOD(defaultFileHeader);
     }
 
     void close() {
+        auto footer = Footer {
+            .tocOffset = static_cast<uint64_t>(ofs.tellp()),
+            .blockSize = blockSize,
+            .alignment = alignment,
+            .alignmentCutoff = alignmentCutoff,
+        };
+        auto toc = tocBuilder.build(footer);
+        footer.tocSize = toc.size();
+        addInfo(toc);
+        if (merkleBlockSize > 0) {
+            addMerkleTree(footer);
+        }
+        addPOD(footer);
         ofs.close();
     }
 
@@ -69,8 +116,44 @@ struct Writer {
             .size      = size,
             .name_size = newNameAsStr.size(),
         };
-        addPOD(state);
-        addInfo(newNameAsStr);
+        if ((type == 0 || type == 2) && size <= inlineCutoff) { // small file or symlink
+            auto content = std::string{};
+            if (type == 0) {
+                content.resize(size);
+                auto ifs = std::ifstream{path, std::ios::binary};
+                ifs.read(content.data(), content.size());
+                content.resize(ifs.gcount());
+            } else {
+                content = read_symlink(path).string();
+            }
+            state.size = content.size();
+            tocBuilder.addInline(state, newNameAsStr, std::move(content));
+            return;
+        }
+        auto contentHash = uint64_t{};
+        if (type == 0 && deduplicate && size > 0) {
+            contentHash = hashFile(path, size);
+            for (auto const& c : contents[contentHash]) {
+                if (equalFiles(path, c.path)) { // is file with known content
+                    state.type = 3;
+                    tocBuilder.add(state, newNameAsStr, c.offset, c.flags, c.blockEnds);
+                    return;
+                }
+            }
+        }
+        if (type == 0 && compressionLevel == 0 && alignment > 0 && size >= alignmentCutoff) {
+            addPadding(alignment);
+        }
+        uint64_t offset = ofs.tellp();
+        if (type == 0 && compressionLevel > 0) { // is file, stored compressed
+            auto blockEnds = addCompressedFile(path);
+            if (deduplicate && size > 0) {
+                contents[contentHash].emplace_back(path, offset, TocEntry::Compressed, blockEnds);
+            }
+            tocBuilder.add(state, newNameAsStr, offset, TocEntry::Compressed, std::move(blockEnds));
+            return;
+        }
+        tocBuilder.add(state, newNameAsStr, offset);
         if (type == 0) { // is file
             auto ifs = std::ifstream{path, std::ios::binary};
             auto buffer = std::vector<char>(65536);
@@ -78,12 +161,102 @@ struct Writer {
                 ifs.read(buffer.data(), buffer.size());
                 ofs.write(buffer.data(), ifs.gcount());
             }
+            if (deduplicate && size > 0) {
+                contents[contentHash].emplace_back(path, offset, uint8_t{0});
+            }
         } else if (type == 2) { // is symlink
             auto symlink = read_symlink(path).string();
             ofs.write(symlink.data(), symlink.size());
         }
     }
 
+    /** adds a regular file with the given content, e.g. generated meta information
+     */
+    void addContentAs(std::string content, std::filesystem::path newName) {
+        auto newNameAsStr = newName.string();
+        auto state = EntryHeader {
+            .uid       = 0,
+            .gid       = 0,
+            .type      = 0,
+            .perms     = 0644,
+            .size      = content.size(),
+            .name_size = newNameAsStr.size(),
+        };
+        if (content.size() <= inlineCutoff) {
+            tocBuilder.addInline(state, newNameAsStr, std::move(content));
+            return;
+        }
+        tocBuilder.add(state, newNameAsStr, ofs.tellp());
+        ofs.write(content.data(), content.size());
+    }
+
+    /** hashes everything written so far and appends the Merkle tree
+     */
+    void addMerkleTree(Footer& footer) {
+        ofs.flush();
+        footer.merkleOffset    = ofs.tellp();
+        footer.merkleBlockSize = merkleBlockSize;
+        auto mapping = MappedFile{path};
+        auto nodes   = computeMerkleTree(mapping.span().subspan(0, footer.merkleOffset), merkleBlockSize, std::thread::hardware_concurrency());
+        addInfo({reinterpret_cast<char const*>(nodes.data()), nodes.size() * sizeof(Hash)});
+    }
+
+    static auto hashFile(std::filesystem::path const& path, uint64_t size) -> uint64_t {
+        auto hash   = std::hash<uint64_t>{}(size);
+        auto ifs    = std::ifstream{path, std::ios::binary};
+        auto buffer = std::vector<char>(65536);
+        while (ifs.read(buffer.data(), buffer.size()) || ifs.gcount() > 0) {
+            hash = hash * 31 + std::hash<std::string_view>{}({buffer.data(), static_cast<size_t>(ifs.gcount())});
+        }
+        return hash;
+    }
+
+    static bool equalFiles(std::filesystem::path const& pathA, std::filesystem::path const& pathB) {
+        auto ifsA    = std::ifstream{pathA, std::ios::binary};
+        auto ifsB    = std::ifstream{pathB, std::ios::binary};
+        auto bufferA = std::vector<char>(65536);
+        auto bufferB = std::vector<char>(65536);
+        while (true) {
+            ifsA.read(bufferA.data(), bufferA.size());
+            ifsB.read(bufferB.data(), bufferB.size());
+            if (ifsA.gcount() != ifsB.gcount()) return false;
+            if (ifsA.gcount() == 0) return true;
+            if (std::memcmp(bufferA.data(), bufferB.data(), ifsA.gcount()) != 0) return false;
+        }
+    }
+
+    /** writes a file as a sequence of zstd frames, one per block
+     *
+     * \return file offsets of the end of each frame
+     */
+    auto addCompressedFile(std::filesystem::path const& path) -> std::vector<uint64_t> {
+        auto blockEnds = std::vector<uint64_t>{};
+        auto ifs    = std::ifstream{path, std::ios::binary};
+        auto buffer = std::vector<char>(blockSize);
+        auto frame  = std::vector<char>(ZSTD_compressBound(blockSize));
+        while (ifs.read(buffer.data(), buffer.size()) || ifs.gcount() > 0) {
+            auto ct = ZSTD_compress(frame.data(), frame.size(), buffer.data(), ifs.gcount(), compressionLevel);
+            if (ZSTD_isError(ct)) {
+                throw std::runtime_error{std::string{"error compressing "} + path.string() + ": " + ZSTD_getErrorName(ct)};
+            }
+            ofs.write(frame.data(), ct);
+            blockEnds.push_back(ofs.tellp());
+        }
+        return blockEnds;
+    }
+
+    /** writes zeros until the file position is a multiple of `alignment`
+     */
+    void addPadding(uint64_t alignment) {
+        static constexpr auto zeros = std::array<char, 4096>{};
+        auto padding = (alignment - static_cast<uint64_t>(ofs.tellp()) % alignment) % alignment;
+        while (padding > 0) {
+            auto ct = std::min<uint64_t>(padding, zeros.size());
+            ofs.write(zeros.data(), ct);
+            padding -= ct;
+        }
+    }
+
     void addInfo(std::span<char const> data) {
         ofs.write(data.data(), data.size());
     }
@@ -1,13 +1,20 @@
 // SPDX-FileCopyrightText: 2023 S. G. Gottlieb <info.simon@gottliebtfreitag.de>
 // SPDX-License-Identifier: AGPL-3.0-only
 
+#include "AccessProfile.h"
 #include "error_fmt.h"
 #include "slix.h"
 
 #include "fsx/Writer.h"
 #include "fsx/Reader.h"
 
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <limits>
 #include <set>
+#include <tuple>
+#include <vector>
 
 namespace {
 void app();
@@ -29,7 +36,33 @@ auto cliOutput = clice::Argument{ .parent = &cli,
                                   .value  = std::filesystem::path{},
 };
 
-void addFolder(std::filesystem::path const& _path, std::filesystem::path const& _rootPath, fsx::Writer& writer) {
+auto cliCompress = clice::Argument{ .parent = &cli,
+                                    .args   = "--compress",
+                                    .desc   = "zstd level to compress file contents with, the archive stays seekable (0: no compression)",
+                                    .value  = int{0},
+};
+
+auto cliAlign = clice::Argument{ .parent = &cli,
+                                 .args   = "--align",
+                                 .desc   = "start uncompressed file contents at page boundaries (4096 bytes), allows mmap based reading",
+};
+
+auto cliAlignCutoff = clice::Argument{ .parent = &cli,
+                                       .args   = "--align-cutoff",
+                                       .desc   = "files smaller than this number of bytes are not aligned (see --align)",
+                                       .value  = uint64_t{16 * 1024},
+};
+
+auto cliProfile = clice::Argument{ .parent = &cli,
+                                   .args   = "--profile",
+                                   .desc   = "profile recorded by slix mount --record-profile, files are stored in the order they were first read"
+                                             " and the accesses are stored as meta/prefetch.txt (unless provided)",
+                                   .value  = std::filesystem::path{},
+};
+
+using PathList = std::vector<std::tuple<std::string, std::string>>; // path and name inside the archive
+
+void addFolder(std::filesystem::path const& _path, std::filesystem::path const& _rootPath, PathList& entries) {
     auto files = std::map<std::string, std::string>{};
     auto folders = std::set<std::string>{};
     for (auto const& dir_entry : std::filesystem::directory_iterator{_path, std::filesystem::directory_options::skip_permission_denied}) {
@@ -42,13 +75,39 @@ void addFolder(std::filesystem::path const& _path, std::filesystem::path const&
     }
 
     for (auto const& [key, value] : files) {
-        writer.addPathAs(key, value);
+        entries.emplace_back(key, value);
     }
     for (auto const& v : folders) {
-        addFolder(v, _rootPath, writer);
+        addFolder(v, _rootPath, entries);
     }
 }
 
+/** moves all files of the profile to the front, in order of their first access
+ *
+ * Returns the accesses of this package (see meta/prefetch.txt).
+ */
+auto applyProfile(PathList& entries, std::filesystem::path const& profilePath, std::filesystem::path const& namePath) -> std::vector<AccessProfile::Access> {
+    auto packageName = std::string{};
+    std::getline(std::ifstream{namePath}, packageName);
+
+    auto profile = AccessProfile{profilePath};
+    auto order   = profile.firstAccess(packageName);
+    if (order.empty()) {
+        fmt::print("profile {} has no entries for package {}\n", profilePath, packageName);
+        return {};
+    }
+    std::ranges::stable_sort(entries, {}, [&](auto const& e) {
+        auto iter = order.find(std::get<1>(e));
+        return (iter != order.end()) ? iter->second : std::numeric_limits<size_t>::max();
+    });
+
+    auto accesses = std::vector<AccessProfile::Access>{};
+    std::ranges::copy_if(profile.accesses, std::back_inserter(accesses), [&](auto const& a) {
+        return a.package == packageName;
+    });
+    return accesses;
+}
+
 
 void app() {
     if (!cliInput) throw error_fmt{"parameter \"--input\" is missing"};
@@ -63,7 +122,23 @@ void app() {
     }
 
     auto wfs = fsx::Writer{*cliOutput};
-    addFolder(*cliInput, *cliInput, wfs);
+    wfs.compressionLevel = *cliCompress;
+    if (cliAlign) {
+        wfs.alignment       = 4096;
+        wfs.alignmentCutoff = *cliAlignCutoff;
+    }
+    auto entries = PathList{};
+    addFolder(*cliInput, *cliInput, entries);
+    auto prefetch = std::vector<AccessProfile::Access>{};
+    if (cliProfile) {
+        prefetch = applyProfile(entries, *cliProfile, *cliInput / "meta/name.txt");
+    }
+    for (auto const& [path, name] : entries) {
+        wfs.addPathAs(path, name);
+    }
+    if (!prefetch.empty() && !exists(*cliInput / "meta/prefetch.txt")) {
+        wfs.addContentAs(AccessProfile::format(prefetch), "meta/prefetch.txt");
+    }
     wfs.close();
 }
 }
@@ -0,0 +1,265 @@
+// SPDX-FileCopyrightText: 2023 S. G. Gottlieb <info.simon@gottliebtfreitag.de>
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#include "Daemon.h"
+#include "Layers.h"
+#include "MyFuse.h"
+#include "slix.h"
+#include "utils.h"
+#include "Stores.h"
+
+#include <chrono>
+#include <clice/clice.h>
+#include <condition_variable>
+#include <csignal>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+void app();
+auto cli = clice::Argument{ .args   = "daemon",
+                            .desc   = "serves the mounts of all slix commands of this user from one process, packages are opened once and shared",
+                            .cb     = app,
+};
+
+auto cliFork = clice::Argument{ .parent = &cli,
+                                .args = "--fork",
+                                .desc = "fork program to run in the background (also ignores SIGHUP)",
+};
+
+auto cliThreads = clice::Argument{ .parent = &cli,
+                                   .args   = "--threads",
+                                   .desc   = "number of threads serving file system requests of each mount (default: number of cores)",
+                                   .value  = size_t{std::max(1u, std::thread::hardware_concurrency())},
+};
+
+auto cliNoCache = clice::Argument{ .parent = &cli,
+                                   .args   = "--no-cache",
+                                   .desc   = "do not let the kernel cache entries, attributes and contents of the immutable packages",
+};
+
+auto cliNoPrefetch = clice::Argument{ .parent = &cli,
+                                      .args   = "--no-prefetch",
+                                      .desc   = "do not load the files listed in meta/prefetch.txt of each package when it is opened",
+};
+
+auto cliVerify = clice::Argument{ .parent = &cli,
+                                  .args = "--verify",
+                                  .desc = "verify file contents against the Merkle tree of each package when they are read"
+};
+
+/**
+ * All mounts served by this process
+ *
+ * Each mount point gets its own fuse session, they share the opened gar files
+ * through `layerCache`. A mount is torn down once its last client closes
+ * slix-lock, a gar file is closed once no mount uses it anymore.
+ */
+struct Daemon {
+    struct Mount {
+        std::unique_ptr<MyFuse> fuse;
+        std::jthread            thread;     // serves fuse requests
+        std::jthread            prefetcher; // loads meta/prefetch.txt of packages opened for this mount
+    };
+
+    std::filesystem::path storePath;
+    LayerCache            layerCache;
+
+    std::mutex                             mutex;
+    std::condition_variable                idleCV;
+    std::unordered_map<std::string, Mount> mounts; // by mount point
+    std::vector<std::string>               idle;   // mount points without clients
+    bool                                   stopping{false};
+
+    struct Client {
+        int          fd;     // -1 once the connection is closed
+        std::jthread thread; // answers the requests of this connection
+    };
+    std::mutex        clientsMutex;
+    std::list<Client> clients;
+
+    void mount(std::string const& mountPoint, std::vector<std::string> const& packages) {
+        auto lock = std::unique_lock{mutex};
+        if (mounts.contains(mountPoint)) return; // mounted by a parallel request
+        lock.unlock();
+
+        auto stores = Stores{storePath}; // reloaded, packages might have been installed since the last request
+        auto requiredPackages = resolvePackages(stores, packages, cliVerbose);
+        auto layers = openLayers(stores, requiredPackages, *cliThreads, cliVerify, cliVerbose, &layerCache);
+
+        if (!std::filesystem::exists(mountPoint)) {
+            std::filesystem::create_directories(mountPoint);
+        }
+
+        lock.lock();
+        if (mounts.contains(mountPoint)) return;
+        auto fuse = std::make_unique<MyFuse>(std::move(layers), cliVerbose, mountPoint, std::vector<std::string>{}, CacheProfile{.enabled = !cliNoCache});
+        auto& m = mounts[mountPoint];
+        m.fuse = std::move(fuse);
+        m.fuse->onIdle = [this, mountPoint]() {
+            auto lock = std::lock_guard{mutex};
+            idle.push_back(mountPoint);
+            idleCV.notify_one();
+        };
+        m.thread = std::jthread{[fuse = m.fuse.get()]() {
+            fuse->loop(*cliThreads);
+        }};
+        if (!cliNoPrefetch) {
+            m.prefetcher = std::jthread{[fuse = m.fuse.get()]() {
+                prefetch(fuse->nodes, *cliThreads, cliVerbose);
+            }};
+        }
+        if (cliVerbose) {
+            fmt::print("mounted {} at {}\n", fmt::join(packages, ", "), mountPoint);
+        }
+    }
+
+    /** unmounts idle mounts, until `stop` is called
+     */
+    void reap() {
+        auto lock = std::unique_lock{mutex};
+        while (true) {
+            idleCV.wait(lock, [&]() { return stopping || !idle.empty(); });
+            if (stopping) break;
+            auto mountPoint = idle.back();
+            idle.pop_back();
+
+            // same grace period as slix mount, so a process can reattach (e.g. after exec)
+            lock.unlock();
+            std::this_thread::sleep_for(std::chrono::milliseconds{100});
+            // commands attaching to a shared mount point hold its lock while probing and opening slix-lock
+            auto mountPointLock = std::optional<MountPointLock>{};
+            try {
+                if (isSharedMountPoint(mountPoint)) mountPointLock.emplace(mountPoint);
+            } catch (std::exception const&) {} // lock file is gone, close anyway
+            lock.lock();
+            auto iter = mounts.find(mountPoint);
+            if (iter == mounts.end() || iter->second.fuse->connectedClients > 0) continue;
+            iter->second.fuse->close();
+            {
+                auto m = std::move(iter->second);
+                mounts.erase(iter);
+                lock.unlock();
+            } // joins the threads and unmounts, without blocking other requests
+            lock.lock();
+            if (cliVerbose) {
+                fmt::print("unmounted {}\n", mountPoint);
+            }
+        }
+        for (auto& [mountPoint, m] : mounts) {
+            m.fuse->close();
+        }
+        auto remaining = std::move(mounts);
+        lock.unlock();
+    }
+
+    void stop() {
+        auto lock = std::lock_guard{mutex};
+        stopping = true;
+        idleCV.notify_one();
+    }
+
+    /** answers the requests of a new client connection on its own thread
+     */
+    void accept(int fd) {
+        auto lock = std::lock_guard{clientsMutex};
+        std::erase_if(clients, [](Client const& c) { return c.fd == -1; }); // joins finished threads
+        auto& client = clients.emplace_back(Client{.fd = fd});
+        client.thread = std::jthread{[this, &client, fd]() {
+            auto connection = DaemonConnection{fd};
+            try {
+                handle(connection);
+            } catch (std::exception const&) {} // client went away
+            auto lock = std::lock_guard{clientsMutex};
+            client.fd = -1;
+        }};
+    }
+
+    /** closes all client connections and waits until their threads are done
+     */
+    void disconnect() {
+        auto lock = std::unique_lock{clientsMutex};
+        for (auto const& c : clients) {
+            if (c.fd != -1) ::shutdown(c.fd, SHUT_RDWR);
+        }
+        auto remaining = std::move(clients);
+        lock.unlock();
+    }
+
+    /** answers all requests of a single client connection
+     */
+    void handle(DaemonConnection& connection) {
+        for (auto request = connection.readFields(); !request.empty(); request = connection.readFields()) {
+            try {
+                if (request[0] == "mount" && request.size() >= 2) {
+                    mount(request[1], {request.begin() + 2, request.end()});
+                    connection.writeFields({"ok"});
+                } else {
+                    connection.writeFields({"error", fmt::format("unknown request {}", request[0])});
+                }
+            } catch (std::exception const& e) {
+                connection.writeFields({"error", e.what()});
+            }
+        }
+    }
+};
+
+int listenFd{-1};
+
+void app() {
+    storeInit();
+
+    auto runtimePath = getSlixRuntimePath(); // created and checked, only this user can access it
+    auto socketPath = runtimePath / "daemon.sock";
+
+    if (DaemonConnection{socketPath}.connected()) {
+        throw error_fmt{"slix daemon is already running ({})", socketPath};
+    }
+    std::filesystem::remove(socketPath); // left over by a daemon that did not shut down
+    listenFd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    auto addr = DaemonConnection::sockaddrOf(socketPath);
+    if (listenFd == -1
+        || ::bind(listenFd, reinterpret_cast<sockaddr const*>(&addr), sizeof(addr)) == -1
+        || ::listen(listenFd, 16) == -1) {
+        throw error_fmt{"failed listening on {}: {}", socketPath, strerror(errno)};
+    }
+    if (cliVerbose) {
+        fmt::print("listening on {}\n", socketPath);
+    }
+
+    // socket is ready before the parent returns, clients can connect right away
+    if (cliFork) {
+        if (fork() != 0) {
+            return;
+        }
+        std::signal(SIGHUP, [](int) {}); // ignore hangup signal
+    }
+    std::signal(SIGINT,  [](int) { ::shutdown(listenFd, SHUT_RDWR); });
+    std::signal(SIGTERM, [](int) { ::shutdown(listenFd, SHUT_RDWR); });
+
+    auto daemon = Daemon{.storePath = getSlixConfigPath() / "stores"};
+    auto reaper = std::jthread{[&]() { daemon.reap(); }};
+    while (true) {
+        auto fd = ::accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+        daemon.accept(fd);
+    }
+    ::close(listenFd);
+    std::filesystem::remove(socketPath);
+    daemon.disconnect(); // handlers might still be mounting, they must be done before `daemon` goes away
+    daemon.stop();
+}
+}
@@ -1,6 +1,7 @@
 // SPDX-FileCopyrightText: 2023 S. G. Gottlieb <info.simon@gottliebtfreitag.de>
 // SPDX-License-Identifier: AGPL-3.0-only
 
+#include "Layers.h"
 #include "slix.h"
 #include "utils.h"
 
@@ -86,21 +87,29 @@ void app() {
             }
             return *cliMountPoint;
         } else {
-            return create_temp_dir().string();
+            storeInit();
+            auto stores = Stores{getSlixConfigPath() / "stores"};
+            return sharedMountPoint(resolvePackages(stores, packages, false)).string();
         }
     }();
     auto call = mountAndWaitCall(clice::argv0, mountPoint, packages, false, *cliMountOptions);
-    while (std::filesystem::is_symlink(call[0]) and std::filesystem::path{call[0]}.filename() != "slix") {
+    while (!call.empty() and std::filesystem::is_symlink(call[0]) and std::filesystem::path{call[0]}.filename() != "slix") {
         auto ncall = std::filesystem::read_symlink(call[0]);
         if (std::filesystem::path{ncall}.is_relative()) {
             call[0] = std::filesystem::canonical(std::filesystem::path{call[0]}.parent_path() / ncall);
         }
     }
-    for (auto a : call) {
-        fmt::print("{} ", quoteStringIfRequired(a));
-    } fmt::print("\n");
-    fmt::print("while [ ! -e {} ]; do sleep 0.1; done\n", quoteStringIfRequired(mountPoint));
-    fmt::print("exec 3<> {}/slix-lock\n", quoteStringIfRequired(mountPoint));
+    if (!call.empty()) { // empty if already mounted (e.g. by slix daemon), otherwise returns once mounted
+        for (auto a : call) {
+            fmt::print("{} ", quoteStringIfRequired(a));
+        } fmt::print("\n");
+    }
+    if (isSharedMountPoint(mountPoint)) {
+        // holds the lock of the mount point while attaching, the mount is not torn down in between (see IdleCloser)
+        fmt::print("exec 4<> {}.lock; flock 4; exec 3< {}/slix-lock; exec 4>&-\n", quoteStringIfRequired(mountPoint), quoteStringIfRequired(mountPoint));
+    } else {
+        fmt::print("exec 3<> {}/slix-lock\n", quoteStringIfRequired(mountPoint));
+    }
 
 
     auto PATH = getPATH();
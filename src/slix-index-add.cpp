@@ -4,13 +4,14 @@
 #include "slix-index.h"
 #include "PackageIndex.h"
 #include "GarFuse.h"
+#include "fsx/Hex.h"
 #include "sha256.h"
 
 #include <clice/clice.h>
 #include <filesystem>
 #include <fmt/format.h>
 #include <fmt/std.h>
-#
+#include <thread>
 
 namespace {
 void app();
@@ -41,7 +42,15 @@ auto prepareIndex(PackageIndex& index, std::filesystem::path indexPath, std::fil
     // Load Package
     auto package = GarFuse{packagePath, false};
 
-    auto hash = fmt::format("{:02x}", fmt::join(sha256sum(packagePath), ""));
+    // packages with a Merkle tree are identified by its root, which is computed on all cores
+    auto merkle = std::string{};
+    if (auto root = package.reader.merkleRoot()) {
+        if (package.reader.computeMerkleRoot(std::thread::hardware_concurrency()) != *root) {
+            throw std::runtime_error{fmt::format("package {} does not match its Merkle tree", packagePath)};
+        }
+        merkle = fsx::toHex(*root);
+    }
+    auto hash = !merkle.empty() ? merkle : fmt::format("{:02x}", fmt::join(sha256sum(packagePath), ""));
     auto fileName = fmt::format("{}@{}#{}.gar", package.name, package.version, hash);
 
     // Check if all required packages are available
@@ -62,6 +71,7 @@ auto prepareIndex(PackageIndex& index, std::filesystem::path indexPath, std::fil
     info.hash         = fmt::format("{}", hash);
     info.description  = package.description;
     info.dependencies = package.dependencies;
+    info.merkle       = merkle;
 
     fmt::print("adding {} as {}\n", package.name, fileName);
     return fileName;
@@ -1,9 +1,13 @@
 // SPDX-FileCopyrightText: 2023 S. G. Gottlieb <info.simon@gottliebtfreitag.de>
 // SPDX-License-Identifier: AGPL-3.0-only
 
+#include "AccessProfile.h"
 #include "GarFuse.h"
+#include "Layers.h"
+#include "LowLevelFuse.h"
 #include "MyFuse.h"
 #include "PackageIndex.h"
+#include "Unpack.h"
 #include "slix.h"
 #include "utils.h"
 #include "Stores.h"
@@ -12,11 +16,12 @@
 #include <clice/clice.h>
 #include <csignal>
 #include <filesystem>
-#include <functional>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <sstream>
 #include <thread>
+#include <type_traits>
 
 namespace {
 void app();
@@ -45,110 +50,172 @@ auto cliMountOptions  = clice::Argument{ .parent = &cli,
 
 auto cliFork = clice::Argument{ .parent = &cli,
                                 .args = "--fork",
-                                .desc = "fork program to run in the background (also ignores SIGHUP)",
+                                .desc = "fork program to run in the background, returns once mounted (also ignores SIGHUP)",
 };
 
 auto cliUnpack = clice::Argument{ .parent = &cli,
                                   .args = "--unpack",
-                                  .desc = "instead of mounting, this will unpack/copy the files to the mount point"
+                                  .desc = "instead of mounting, this will unpack/copy the files to the mount point (using --threads threads)"
 };
 
-void app() {
-    if (!std::filesystem::exists(*cliMountPoint)) {
-        std::filesystem::create_directories(*cliMountPoint);
-    }
+auto cliCache = clice::Argument{ .parent = &cli,
+                                 .args   = "--cache",
+                                 .desc   = "with --unpack, extract files once into a cache of their store and link them from there (reflinks if supported, otherwise hard links, which share changes with the cache)",
+};
+
+auto cliUpper = clice::Argument{ .parent = &cli,
+                                 .args   = "--upper",
+                                 .desc   = "makes the mount writable, changes are stored in this directory (files of the packages are copied up before they are changed, deletions are recorded as .wh.<name> whiteouts)",
+                                 .value  = std::filesystem::path{},
+};
+
+auto cliThreads = clice::Argument{ .parent = &cli,
+                                   .args   = "--threads",
+                                   .desc   = "number of threads serving file system requests (default: number of cores)",
+                                   .value  = size_t{std::max(1u, std::thread::hardware_concurrency())},
+};
+
+auto cliLowLevel = clice::Argument{ .parent = &cli,
+                                    .args   = "--lowlevel",
+                                    .desc   = "use the fuse low level api, entries are addressed by inode numbers instead of paths (allows fuse passthrough)",
+};
 
-    storeInit();
-    auto storePath = getSlixConfigPath() / "stores";
+auto cliNoCache = clice::Argument{ .parent = &cli,
+                                   .args   = "--no-cache",
+                                   .desc   = "do not let the kernel cache entries, attributes and contents of the immutable packages",
+};
 
-    // Go through store by store and list gather all requested packages and their dependencies
-    // Paths to the required packages
-    auto requiredPackages = std::unordered_map<std::string, std::filesystem::path>{};
+auto cliRecordProfile = clice::Argument{ .parent = &cli,
+                                         .args   = "--record-profile",
+                                         .desc   = "records which files are read in which order into this file when unmounting (see slix archive --profile)",
+                                         .value  = std::filesystem::path{},
+};
 
-    auto stores = Stores{storePath};
-    for (auto requested_name : *cliPackages) {
-        auto [store, name] = stores.findNewestPackageByName(requested_name, /*installed = */ true);
-        if (name.empty()) {
-            throw error_fmt{"package {} not found", requested_name};
+auto cliNoPrefetch = clice::Argument{ .parent = &cli,
+                                      .args   = "--no-prefetch",
+                                      .desc   = "do not load the files listed in meta/prefetch.txt of each package when mounting",
+};
+
+auto cliVerify = clice::Argument{ .parent = &cli,
+                                  .args = "--verify",
+                                  .desc = "verify file contents against the Merkle tree of each package when they are read"
+};
+
+// background process of --fork, reports to the parent once mounted
+std::optional<ReadyPipe> readyPipe;
+
+// held until mounted, if mounting a shared mount point
+std::optional<MountPointLock> mountPointLock;
+
+/** mounts the layers and serves them until unmounted
+ */
+template <typename FuseFS>
+void serve(Layers layers) {
+    static auto closer = std::atomic<IdleCloser*>{}; // for the SIGINT handler
+
+    auto profile = AccessProfile{};
+    if (cliRecordProfile) {
+        for (auto& layer : layers) {
+            layer->profile = &profile;
         }
-        auto [knownList, installedStore] = stores.findExactPattern(name);
-        if (!installedStore) {
-            // load Gar from file
-            if (exists(std::filesystem::path(name)) && name.ends_with(".gar")) {
-                auto package_name = std::filesystem::path{name}.stem().string();
-                if (auto iter = requiredPackages.find(package_name); iter != requiredPackages.end()) {
-                    continue;
-                }
-                requiredPackages[package_name] = name;
-                auto gar = GarFuse{std::filesystem::path{name}, cliVerbose};
-                for (auto d : gar.dependencies) {
-                    if (requiredPackages.find(d) != requiredPackages.end()) {
-                        continue;
-                    }
-                    auto [knownList, installedStore] = stores.findExactPattern(d);
-                    if (!installedStore) {
-                        throw error_fmt{"package {} not installed, required for {}", d, name};
-                    }
-                    requiredPackages[d] = installedStore->getPackagePath(d);
-                }
-            } else {
-                throw error_fmt{"package {}({}) not installed", requested_name, name};
-            }
+    }
+    auto cacheProfile = CacheProfile{.enabled = !cliNoCache, .writable = cliUpper};
+    auto fuseFS = [&]() {
+        if constexpr (std::is_same_v<FuseFS, MyFuse>) {
+            auto upper = cliUpper ? std::optional{UpperLayer{std::filesystem::absolute(*cliUpper)}} : std::nullopt;
+            return FuseFS{std::move(layers), cliVerbose, *cliMountPoint, *cliMountOptions, cacheProfile, std::move(upper)};
         } else {
-            // Loading Gar from store
-            if (requiredPackages.find(name) != requiredPackages.end()) {
-                continue;
-            }
-            requiredPackages[name] = installedStore->getPackagePath(name);
-            for (auto d : installedStore->loadPackageIndex().findDependencies(name)) {
-                requiredPackages[d] = installedStore->getPackagePath(d);
-            }
+            return FuseFS{std::move(layers), cliVerbose, *cliMountPoint, *cliMountOptions, cacheProfile};
         }
+    }();
+    auto idleCloser = IdleCloser{fuseFS};
+    fuseFS.onIdle = [&]() { idleCloser.idle(); };
+
+    if (readyPipe) {
+        std::signal(SIGHUP, [](int) {}); // ignore hangup signal
+        std::signal(SIGINT, [](int) {});
+    } else {
+        closer = &idleCloser;
+        std::signal(SIGINT, [](int) { if (auto c = closer.load()) { c->exit(); } });
+    }
+    if (readyPipe) {
+        readyPipe->ready(); // lets the parent exit, requests are queued until the loop runs
     }
+    if (mountPointLock) {
+        mountPointLock->unlock();
+    }
+
+    // warm up caches while the first requests are served
+    auto prefetcher = std::jthread{};
+    if (!cliNoPrefetch) {
+        prefetcher = std::jthread{[&]() { prefetch(fuseFS.nodes, *cliThreads, cliVerbose); }};
+    }
+    fuseFS.loop(*cliThreads);
+    closer = nullptr;
+    if (cliRecordProfile) {
+        profile.storeFile(*cliRecordProfile);
+    }
+}
 
-    auto layers = std::vector<GarFuse>{};
-    for (auto const& [name, path] : requiredPackages) {
-        layers.emplace_back(path, cliVerbose);
+void app() {
+    // concurrent commands activating the same environment (e.g. slix env) mount it only once
+    if (!cliUnpack && isSharedMountPoint(*cliMountPoint)) {
+        mountPointLock.emplace(*cliMountPoint);
+        if (isServed(*cliMountPoint, *cliPackages, cliVerbose, *cliMountOptions)) return;
     }
 
-    if (cliUnpack) {
-        auto tempMount = *cliMountPoint + "/slix-temporary-mount-fs";
-        std::filesystem::create_directories(tempMount);
-        auto fuseFS = MyFuse{std::move(layers), cliVerbose, tempMount, *cliMountOptions};
-        auto thread = std::jthread{[&]() {
-            fuseFS.loop();
-        }};
-        for (auto const& dir_entry : std::filesystem::directory_iterator{tempMount}) {
-            if (dir_entry.path() == tempMount + "/slix-lock") continue;
-            std::system(fmt::format("cp -ar \"{}\" \"{}\"", dir_entry.path(), *cliMountPoint).c_str());
+    // fork before any thread is started, the parent waits until the child is mounted
+    if (cliFork && !cliUnpack) {
+        readyPipe = ReadyPipe::fork();
+        if (!readyPipe) return;
+    }
+
+    try {
+        if (cliUpper && (cliLowLevel || cliUnpack)) {
+            throw error_fmt{"--upper can not be combined with --lowlevel or --unpack"};
         }
-        fuseFS.close();
-        std::filesystem::remove(tempMount);
-    } else {
-        static auto onExit = std::function<void(int)>{};
-
-        auto fuseFS = MyFuse{std::move(layers), cliVerbose, *cliMountPoint, *cliMountOptions};
-        std::jthread thread;
-        onExit = [&](int) {
-            thread = std::jthread{[&]() {
-                std::this_thread::sleep_for(std::chrono::milliseconds{100});
-                fuseFS.close();
-            }};
-        };
-
-        if (cliFork) {
-            if (fork() != 0) {
-                fuseFS.mountPoint = "";
-                return;
+        if (!std::filesystem::exists(*cliMountPoint)) {
+            std::filesystem::create_directories(*cliMountPoint);
+        }
+        if (cliUpper) {
+            std::filesystem::create_directories(*cliUpper);
+        }
+
+        storeInit();
+        auto storePath = getSlixConfigPath() / "stores";
+
+        // Go through store by store and list gather all requested packages and their dependencies
+        auto stores = Stores{storePath};
+        auto requiredPackages = resolvePackages(stores, *cliPackages, cliVerbose);
+        auto layers = openLayers(stores, requiredPackages, *cliThreads, cliVerify, cliVerbose);
+
+        if (cliUnpack) {
+            auto unpack = Unpack{.layers = layers, .target = *cliMountPoint, .verbose = cliVerbose};
+            auto caches = std::vector<ExtractCache>(layers.size());
+            if (cliCache) {
+                for (size_t i{0}; i < layers.size(); ++i) {
+                    auto [knownList, installedStore] = stores.findExactPattern(std::get<0>(requiredPackages[i]));
+                    if (installedStore) { // packages not installed in any store are extracted as usual
+                        caches[i] = installedStore->getExtractCache();
+                        unpack.caches.push_back(&caches[i]);
+                    } else {
+                        unpack.caches.push_back(nullptr);
+                    }
+                }
             }
-            std::signal(SIGHUP, [](int) {}); // ignore hangup signal
-            std::signal(SIGINT, [](int) {});
-        } else {
-            std::signal(SIGINT, [](int signal) { if (onExit) { onExit(signal); } });
+            unpack.run(*cliThreads);
+            return;
         }
-        std::signal(SIGUSR1, [](int signal) { if (onExit) { onExit(signal); } });
 
-        fuseFS.loop();
+        if (cliLowLevel) {
+            serve<LowLevelFuse>(std::move(layers));
+        } else {
+            serve<MyFuse>(std::move(layers));
+        }
+    } catch (std::exception const& e) {
+        if (!readyPipe) throw;
+        readyPipe->failed(e.what()); // reported by the parent
+        std::exit(1);
     }
 }
 }
@@ -1,6 +1,7 @@
 // SPDX-FileCopyrightText: 2023 S. G. Gottlieb <info.simon@gottliebtfreitag.de>
 // SPDX-License-Identifier: AGPL-3.0-only
 
+#include "Layers.h"
 #include "MyFuse.h"
 #include "slix.h"
 #include "utils.h"
@@ -11,11 +12,12 @@
 #include <clice/clice.h>
 #include <csignal>
 #include <filesystem>
-#include <functional>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <sstream>
 #include <thread>
+#include <unistd.h>
 
 namespace {
 void app();
@@ -41,26 +43,52 @@ auto cliMountOptions  = clice::Argument{ .parent = &cli,
                                          .value = std::vector<std::string>{},
 };
 
+auto cliThreads = clice::Argument{ .parent = &cli,
+                                   .args   = "--threads",
+                                   .desc   = "number of threads serving file system requests (default: number of cores)",
+                                   .value  = size_t{0},
+};
+
 auto cliStack = clice::Argument{ .parent = &cli,
                                  .args   = "--stack",
                                  .desc   = "Will add paths to PATH instead of overwritting, allows stacking behavior",
 };
 
+/** mounts the packages in a background process, only returns in the calling process once mounted
+ *
+ * Instead of calling `slix mount --fork`, this forks the current process. The
+ * background process serves the mount until the last client closed slix-lock.
+ */
+void serveInBackground(Stores& stores, PackageList const& packages, std::filesystem::path const& mountPoint) {
+    auto readyPipe = ReadyPipe::fork();
+    if (!readyPipe) return;
+
+    try {
+        auto threads = *cliThreads > 0 ? *cliThreads : size_t{std::max(1u, std::thread::hardware_concurrency())};
+        auto layers = openLayers(stores, packages, threads, /*.verify=*/false, cliVerbose);
+        std::filesystem::create_directories(mountPoint); // removed again when unmounted
+        auto fuseFS = MyFuse{std::move(layers), cliVerbose, mountPoint, *cliMountOptions};
+
+        // same grace period as slix mount, a client might attach in the meantime
+        auto idleCloser = IdleCloser{fuseFS};
+        fuseFS.onIdle = [&]() { idleCloser.idle(); };
+        std::signal(SIGHUP, [](int) {}); // ignore hangup signal
+        std::signal(SIGINT, [](int) {});
+        readyPipe->ready();
+
+        auto prefetcher = std::jthread{[&]() { prefetch(fuseFS.nodes, threads, cliVerbose); }};
+        fuseFS.loop(threads);
+    } catch (std::exception const& e) {
+        readyPipe->failed(e.what()); // reported by the calling process
+        std::exit(1);
+    }
+    std::exit(0);
+}
+
 void app() {
     storeInit();
     auto storePath = getSlixConfigPath() / "stores";
 
-    auto mountPoint = [&]() -> std::string {
-        if (cliMountPoint) {
-            if (!std::filesystem::exists(*cliMountPoint)) {
-                std::filesystem::create_directory(*cliMountPoint);
-            }
-            return *cliMountPoint;
-        } else {
-            return create_temp_dir().string();
-        }
-    }();
-
     auto requestedPackages = std::vector<std::string>{};
     for (auto i : *cli) {
         // Check if it a file
@@ -82,9 +110,33 @@ void app() {
         }
     }
 
-    auto handle = mountAndWait(clice::argv0, mountPoint, requestedPackages, cliVerbose, *cliMountOptions);
-
     auto stores = Stores{storePath};
+    auto requiredPackages = resolvePackages(stores, requestedPackages, cliVerbose);
+
+    auto mountPoint = [&]() -> std::string {
+        if (cliMountPoint) {
+            if (!std::filesystem::exists(*cliMountPoint)) {
+                std::filesystem::create_directory(*cliMountPoint);
+            }
+            return *cliMountPoint;
+        } else {
+            return sharedMountPoint(requiredPackages).string();
+        }
+    }();
+
+    // concurrent runs of the same environment wait for each other, so only one of them mounts
+    auto lock = cliMountPoint ? std::optional<MountPointLock>{} : std::optional<MountPointLock>{std::in_place, mountPoint};
+    if (!isServed(mountPoint, requestedPackages, cliVerbose, *cliMountOptions)) {
+        serveInBackground(stores, requiredPackages, mountPoint);
+    }
+    auto handle = std::ifstream{mountPoint + "/slix-lock"};
+    if (!handle.is_open()) {
+        throw error_fmt{"failed attaching to mount {}", mountPoint};
+    }
+    if (lock) {
+        lock->unlock(); // explicitly, the background process shares the lock file
+    }
+
     auto installedPackagePaths = std::unordered_map<std::string, std::filesystem::path>{};
     for (auto i : stores.installedPackages) {
         installedPackagePaths.try_emplace(i, stores.getPackagePath(i));
@@ -53,6 +53,7 @@ void app() {
             }
         }
         fmt::print("  - name: {}\n", store.name);
+        fmt::print("    type: {}\n", store.config.type);
         fmt::print("    path: {}\n", getSlixStatePath() / store.name);
         fmt::print("    url: {}\n", s.url);
         fmt::print("    url_type: {}\n", s.type);
@@ -1,22 +1,32 @@
 // SPDX-FileCopyrightText: 2023 S. G. Gottlieb <info.simon@gottliebtfreitag.de>
 // SPDX-License-Identifier: AGPL-3.0-only
 #pragma once
+#include "Daemon.h"
 #include "GarFuse.h"
 #include "PackageIndex.h"
 
+#include <cerrno>
 #include <cstdlib>
+#include <cstring>
 #include <curl/curl.h>
+#include <fcntl.h>
 #include <filesystem>
+#include <functional>
 #include <indicators/cursor_control.hpp>
 #include <indicators/progress_bar.hpp>
 #include <indicators/block_progress_bar.hpp>
+#include <memory>
+#include <optional>
 #include <random>
 #include <ranges>
 #include <string>
 #include <string_view>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <unordered_set>
+#include <zstd.h>
 
 inline auto isTerminal(size_t t) {
     return isatty(t);
@@ -172,6 +182,34 @@ inline auto getSlixStatePath() -> std::filesystem::path {
     throw std::runtime_error{"unknown HOME and XDG_STATE_HOME"};
 }
 
+/**
+ * Path to the $XDG_RUNTIME_DIR/slix path (sockets and other files of running slix processes)
+ *
+ * Created if missing. The fallback in /tmp is predictable, another user could
+ * create it first and plant a socket or mounts, so it is only used if it is a
+ * directory owned by this user that nobody else can access.
+ */
+inline auto getSlixRuntimePath() -> std::filesystem::path {
+    auto ptr  = std::getenv("XDG_RUNTIME_DIR");
+    auto path = ptr ? std::filesystem::path{ptr + std::string{"/slix"}}
+                    : std::filesystem::path{fmt::format("/tmp/slix-{}", getuid())};
+    if (::mkdir(path.c_str(), 0700) != 0 && errno != EEXIST) {
+        throw error_fmt{"failed creating {}: {}", path, strerror(errno)};
+    }
+    struct stat st;
+    if (::lstat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode) && st.st_uid == getuid()
+        && (st.st_mode & 07777) != 0700 && !(st.st_mode & (S_IWGRP | S_IWOTH))) {
+        ::chmod(path.c_str(), 0700); // created by an older version of slix, nobody else could write to it
+    }
+    if (::lstat(path.c_str(), &st) != 0
+        || !S_ISDIR(st.st_mode)
+        || st.st_uid != getuid()
+        || (st.st_mode & 07777) != 0700) {
+        throw error_fmt{"refusing to use {}, it must be a directory owned by uid {} with permissions 0700", path, getuid()};
+    }
+    return path;
+}
+
 /**
  * Path to the last loaded environment file (or empty if non available)
  */
@@ -207,12 +245,41 @@ inline auto searchPackagePath(std::vector<std::filesystem::path> const& slixPkgP
     throw std::runtime_error{"couldn't find path for " + name};
 }
 
+/** decompresses a .zst file next to it and removes the compressed file
+ */
 inline void unpackZstFile(std::filesystem::path file) {
     // extract file
     auto dest = file;
     dest.replace_extension();
-    auto call = fmt::format("zstd -q -d --rm {} -o {}", file, dest);
-    std::system(call.c_str());
+
+    auto stream = std::unique_ptr<ZSTD_DStream, decltype(&ZSTD_freeDStream)>{ZSTD_createDStream(), &ZSTD_freeDStream};
+    if (!stream) throw error_fmt{"failed setting up zstd decompression"};
+    ZSTD_initDStream(stream.get());
+
+    auto ifs = std::ifstream{file, std::ios::binary};
+    auto ofs = std::ofstream{dest, std::ios::binary};
+    if (!ifs.good()) throw error_fmt{"failed opening {}", file};
+    if (!ofs.good()) throw error_fmt{"failed opening {}", dest};
+
+    auto inBuffer  = std::vector<char>(ZSTD_DStreamInSize());
+    auto outBuffer = std::vector<char>(ZSTD_DStreamOutSize());
+    auto lastRet   = size_t{0};
+    while (ifs.read(inBuffer.data(), inBuffer.size()) || ifs.gcount() > 0) {
+        auto input = ZSTD_inBuffer{inBuffer.data(), static_cast<size_t>(ifs.gcount()), 0};
+        while (input.pos < input.size) {
+            auto output = ZSTD_outBuffer{outBuffer.data(), outBuffer.size(), 0};
+            lastRet = ZSTD_decompressStream(stream.get(), &output, &input);
+            if (ZSTD_isError(lastRet)) {
+                throw error_fmt{"failed decompressing {}: {}", file, ZSTD_getErrorName(lastRet)};
+            }
+            ofs.write(outBuffer.data(), output.pos);
+        }
+    }
+    if (lastRet != 0) {
+        throw error_fmt{"failed decompressing {}: file is truncated", file};
+    }
+    ofs.close();
+    std::filesystem::remove(file);
 }
 
 //!TODO curl is not cleanup properly on failure (how does anyone does this without RAII?)
@@ -285,43 +352,154 @@ inline void execute(std::vector<std::string> const& _argv, std::map<std::string,
     execvpe(argv[0], (char**)argv.data(), (char**)envp.data());
 }
 
-inline auto mountAndWaitCall(std::filesystem::path argv0, std::filesystem::path mountPoint, std::vector<std::string> const& packages, bool verbose, std::vector<std::string> const& mountOptions) -> std::vector<std::string> {
-    auto call = std::vector<std::string>{};
-    if (!std::filesystem::exists(std::filesystem::path{mountPoint} / "slix-lock")) {
-        if (verbose) {
-            fmt::print("argv0: {}\n", argv0);
-            fmt::print("self-exe: {}\n", std::filesystem::canonical("/proc/self/exe"));
+/**
+ * Lets a forked process tell its parent when it is ready (or why it failed)
+ *
+ * Used by `slix mount --fork`: the parent only exits once the file system is
+ * mounted, so callers can use the mount right after the call returns.
+ */
+struct ReadyPipe {
+    int fd{-1}; // write end, only in the child
+
+    /** forks, only the child returns
+     *
+     * The parent waits until the child calls `ready` and then returns nullopt,
+     * or throws the error reported by the child.
+     */
+    static auto fork() -> std::optional<ReadyPipe> {
+        int fds[2];
+        if (::pipe2(fds, O_CLOEXEC) == -1) {
+            throw error_fmt{"failed creating pipe: {}", strerror(errno)};
+        }
+        auto pid = ::fork();
+        if (pid == -1) {
+            throw error_fmt{"failed forking: {}", strerror(errno)};
+        }
+        if (pid == 0) {
+            ::close(fds[0]);
+            return ReadyPipe{fds[1]};
         }
-        auto binary = std::filesystem::canonical("/proc/self/exe").parent_path().parent_path() / "bin" / argv0.filename();
-        call.push_back(binary.string());
+        ::close(fds[1]);
+        auto message = std::string{};
+        char buffer[256];
+        for (ssize_t ct; (ct = ::read(fds[0], buffer, sizeof(buffer))) != 0;) {
+            if (ct == -1 && errno == EINTR) continue;
+            if (ct == -1) break;
+            message.append(buffer, ct);
+        }
+        ::close(fds[0]);
+        if (message == "ready") return std::nullopt;
+        if (message.empty()) {
+            throw error_fmt{"background process exited unexpectedly"};
+        }
+        throw error_fmt{"{}", message};
+    }
+
+    void ready() { report("ready"); }
+    void failed(std::string_view message) { report(message); }
+
+private:
+    void report(std::string_view message) {
+        if (fd == -1) return;
+        [[maybe_unused]] auto ct = ::write(fd, message.data(), message.size()); // nothing to do if the parent is gone
+        ::close(fd);
+        fd = -1;
+    }
+};
 
+/** runs `argv` (searched in PATH) without a shell and waits for it
+ *
+ * \return exit status, -1 if it could not be started or was killed
+ */
+inline auto runProcess(std::vector<std::string> const& argv) -> int {
+    auto args = std::vector<char*>{};
+    for (auto const& a : argv) {
+        args.push_back(const_cast<char*>(a.c_str()));
+    }
+    args.push_back(nullptr);
+
+    auto pid = ::fork();
+    if (pid == -1) return -1;
+    if (pid == 0) {
+        ::execvp(args[0], args.data());
+        ::_exit(127);
+    }
+    int status{};
+    while (::waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/** true if the mount point is served already, or was just mounted by a running slix daemon
+ *
+ * A mount left behind by a killed process is unmounted first.
+ */
+inline auto isServed(std::filesystem::path const& mountPoint, std::vector<std::string> const& packages, bool verbose, std::vector<std::string> const& mountOptions) -> bool {
+    // mount process is gone without unmounting (e.g. killed), the mount point is not usable until unmounted
+    struct stat st;
+    if (::stat((mountPoint / "slix-lock").c_str(), &st) == -1 && errno == ENOTCONN) {
         if (verbose) {
-            call.push_back("--verbose");
+            fmt::print("unmounting stale mount {}\n", mountPoint);
         }
-        call.push_back("mount");
-        call.push_back("--fork");
-        call.push_back("--mount");
-        call.push_back(mountPoint.string());
-//        if (allowOther) {
-//            call.push_back("--allow_other");
-//        }
-        call.push_back("-p");
-        for (auto p : packages) {
-            call.push_back(p);
+        if (auto status = runProcess({"fusermount3", "-u", "-z", mountPoint.string()}); status != 0) {
+            throw error_fmt{"failed unmounting stale mount {} (fusermount3 exit status {})", mountPoint, status};
         }
-        if (!mountOptions.empty()) {
-            call.push_back("--options");
-            call.push_back("--");
-            for (auto const& o : mountOptions) {
-                call.push_back(o);
-            }
+    }
+    if (std::filesystem::exists(mountPoint / "slix-lock")) return true;
+
+    // a running slix daemon mounts with packages it already has opened (mount options are not supported)
+    if (mountOptions.empty() && requestDaemonMount(getSlixRuntimePath() / "daemon.sock", mountPoint, packages)) {
+        if (verbose) {
+            fmt::print("mounted by slix daemon\n");
+        }
+        return true;
+    }
+    return false;
+}
+
+inline auto mountAndWaitCall(std::filesystem::path argv0, std::filesystem::path mountPoint, std::vector<std::string> const& packages, bool verbose, std::vector<std::string> const& mountOptions, size_t threads = 0) -> std::vector<std::string> {
+    auto call = std::vector<std::string>{};
+    if (isServed(mountPoint, packages, verbose, mountOptions)) {
+        return call;
+    }
+    if (verbose) {
+        fmt::print("argv0: {}\n", argv0);
+        fmt::print("self-exe: {}\n", std::filesystem::canonical("/proc/self/exe"));
+    }
+    auto binary = std::filesystem::canonical("/proc/self/exe").parent_path().parent_path() / "bin" / argv0.filename();
+    call.push_back(binary.string());
+
+    if (verbose) {
+        call.push_back("--verbose");
+    }
+    call.push_back("mount");
+    call.push_back("--fork");
+    call.push_back("--mount");
+    call.push_back(mountPoint.string());
+    if (threads > 0) {
+        call.push_back("--threads");
+        call.push_back(std::to_string(threads));
+    }
+//    if (allowOther) {
+//        call.push_back("--allow_other");
+//    }
+    call.push_back("-p");
+    for (auto p : packages) {
+        call.push_back(p);
+    }
+    if (!mountOptions.empty()) {
+        call.push_back("--options");
+        call.push_back("--");
+        for (auto const& o : mountOptions) {
+            call.push_back(o);
         }
     }
     return call;
 }
 
-inline auto mountAndWait(std::filesystem::path argv0, std::filesystem::path mountPoint, std::vector<std::string> const& packages, bool verbose, std::vector<std::string> const& mountOptions) -> std::ifstream {
-    auto call = mountAndWaitCall(argv0, mountPoint, packages, verbose, mountOptions);
+inline auto mountAndWait(std::filesystem::path argv0, std::filesystem::path mountPoint, std::vector<std::string> const& packages, bool verbose, std::vector<std::string> const& mountOptions, size_t threads = 0) -> std::ifstream {
+    auto call = mountAndWaitCall(argv0, mountPoint, packages, verbose, mountOptions, threads);
     if (!call.empty()) {
         auto callStr = fmt::format("{}", fmt::join(call, " "));
         if (verbose) {
@@ -332,10 +510,10 @@ inline auto mountAndWait(std::filesystem::path argv0, std::filesystem::path moun
             throw error_fmt{"error running {}", callStr};
         }
     }
-    auto ifs = std::ifstream{};
-    while (!ifs.is_open()) {
-        std::this_thread::sleep_for(std::chrono::milliseconds{10}); //!TODO can we do this better to wait for slix-mount to finish?
-        ifs.open(mountPoint / "slix-lock");
+    // mount call only returns once mounted (see ReadyPipe)
+    auto ifs = std::ifstream{mountPoint / "slix-lock"};
+    if (!ifs.is_open()) {
+        throw error_fmt{"failed attaching to mount {}", mountPoint};
     }
     return ifs;
 }
@@ -0,0 +1,18 @@
+#!/usr/bin/env bash
+# SPDX-FileCopyrightText: 2023 S. G. Gottlieb <info.simon@gottliebtfreitag.de>
+# SPDX-License-Identifier: CC0-1.0
+
+# builds and runs every tests/test-*.cpp, they do not need fuse or network access
+
+set -Eeuo pipefail
+
+mkdir -p build/tests
+FLAGS="-std=c++23 -D_FILE_OFFSET_BITS=64 -isystem libs/clice/src -Isrc -ggdb -O0"
+
+failed=0
+for test in tests/test-*.cpp; do
+    name=$(basename ${test} .cpp)
+    ccache g++ ${FLAGS} ${test} -o build/tests/${name} -lfmt -lcrypto -lzstd -lpthread
+    build/tests/${name} || failed=1
+done
+exit ${failed}
@@ -0,0 +1,66 @@
+// SPDX-FileCopyrightText: 2023 S. G. Gottlieb <info.simon@gottliebtfreitag.de>
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#include "test.h"
+#include "ExtractCache.h"
+
+namespace {
+auto addObject(ExtractCache const& cache, std::string const& content) -> std::string {
+    auto path = cache.tempPath();
+    writeFile(path, content);
+    return cache.add(path);
+}
+
+void storeIndex(ExtractCache const& cache, std::string const& package, std::vector<std::string> const& objects) {
+    auto index = ExtractCache::Index{};
+    index.package = package;
+    index.stamp   = "0";
+    for (size_t i{0}; i < objects.size(); ++i) {
+        index.set(i, objects[i]);
+    }
+    cache.storeIndex(index);
+}
+
+/** removing a package only removes the objects no other package references */
+void testRemovePackage() {
+    auto dir   = TempDir{};
+    auto cache = ExtractCache{dir.path / "cache"};
+
+    auto shared  = addObject(cache, "shared");
+    auto onlyA   = addObject(cache, "only a");
+    auto onlyB   = addObject(cache, "only b");
+    auto unknown = addObject(cache, "not referenced");
+    CHECK(addObject(cache, "shared") == shared);
+    storeIndex(cache, "a", {shared, onlyA});
+    storeIndex(cache, "b", {shared, onlyB});
+
+    cache.removePackage("b");
+    CHECK(!exists(dir.path / "cache/index/b"));
+    CHECK(exists(cache.objectPath(shared)));
+    CHECK(exists(cache.objectPath(onlyA)));
+    CHECK(!exists(cache.objectPath(onlyB)));
+    CHECK(!exists(cache.objectPath(unknown)));
+
+    cache.removePackage("a");
+    CHECK(!exists(cache.objectPath(shared)));
+    CHECK(!exists(cache.objectPath(onlyA)));
+}
+
+/** removing objects waits for everyone unpacking into the cache */
+void testLock() {
+    auto dir   = TempDir{};
+    auto cache = ExtractCache{dir.path / "cache"};
+    auto shared = cache.lock(/*.exclusive=*/false);
+    auto fd = ::open((dir.path / "cache/lock").c_str(), O_RDWR | O_CLOEXEC);
+    CHECK(fd != -1);
+    CHECK(::flock(fd, LOCK_EX | LOCK_NB) == -1 && errno == EWOULDBLOCK);
+    CHECK(::flock(fd, LOCK_SH | LOCK_NB) == 0);
+    ::close(fd);
+}
+}
+
+int main() {
+    testRemovePackage();
+    testLock();
+    return testResult("test-extract-cache");
+}
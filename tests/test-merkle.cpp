@@ -0,0 +1,50 @@
+// SPDX-FileCopyrightText: 2023 S. G. Gottlieb <info.simon@gottliebtfreitag.de>
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#include "test.h"
+#include "fsx/Merkle.h"
+
+#include <cstring>
+
+using namespace fsx;
+
+namespace {
+/** a leaf holding the concatenation of two hashes must not match the node over them */
+void testLeafNodeSeparation() {
+    auto data  = std::string(64, 'a');
+    auto left  = merkleLeafHash(std::span{data}.subspan(0, 32));
+    auto right = merkleLeafHash(std::span{data}.subspan(32));
+    auto pair  = std::array{left, right};
+    auto node  = merkleNodeHash(pair);
+
+    auto concatenated = std::string(64, '\0');
+    std::memcpy(concatenated.data(), left.data(), 32);
+    std::memcpy(concatenated.data() + 32, right.data(), 32);
+    CHECK(merkleLeafHash(concatenated) != node);
+    CHECK(merkleNodeHash(std::span{pair}.subspan(0, 1)) != left);
+}
+
+/** the root depends on the content, the block size and the size of the range */
+void testRoot() {
+    auto data = std::string(10000, '\0');
+    for (size_t i{0}; i < data.size(); ++i) data[i] = static_cast<char>(i * 7 % 251);
+
+    auto nodes = computeMerkleTree(data, 4096, 1);
+    CHECK(nodes.size() == merkleNodeCount(merkleLeafCount(data.size(), 4096)));
+    CHECK(nodes == computeMerkleTree(data, 4096, 4));
+    CHECK(nodes[0] == merkleLeafHash(std::span{data}.subspan(0, 4096)));
+
+    auto root = merkleRoot(nodes.back(), 4096, data.size());
+    CHECK(root != merkleRoot(nodes.back(), 8192, data.size()));
+    CHECK(root != merkleRoot(nodes.back(), 4096, data.size() + 1));
+
+    data[5000] ^= 1;
+    CHECK(computeMerkleTree(data, 4096, 1).back() != nodes.back());
+}
+}
+
+int main() {
+    testLeafNodeSeparation();
+    testRoot();
+    return testResult("test-merkle");
+}
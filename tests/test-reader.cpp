@@ -0,0 +1,123 @@
+// SPDX-FileCopyrightText: 2023 S. G. Gottlieb <info.simon@gottliebtfreitag.de>
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#include "test.h"
+#include "fsx/Reader.h"
+#include "fsx/Writer.h"
+
+using namespace fsx;
+
+namespace {
+auto pattern(size_t size, size_t seed) -> std::string {
+    auto s = std::string(size, '\0');
+    for (size_t i{0}; i < size; ++i) s[i] = static_cast<char>((i * 7 + seed) % 251);
+    return s;
+}
+
+auto readAll(Reader& reader, TocEntry const& e, size_t offset, size_t count) -> std::string {
+    auto buf = std::string(count, '\0');
+    buf.resize(reader.read(e, buf.data(), count, offset));
+    return buf;
+}
+
+/** reads of compressed files crossing block boundaries and the end of the file */
+void testCompressedRead() {
+    auto dir     = TempDir{};
+    auto content = pattern(20000, 0);
+    writeFile(dir.path / "big", content);
+    {
+        auto writer = Writer{dir.path / "test.gar"};
+        writer.compressionLevel = 3;
+        writer.blockSize        = 4096;
+        writer.addPathAs(dir.path / "big", "big");
+        writer.close();
+    }
+    auto reader = Reader{dir.path / "test.gar"};
+    auto e      = reader.toc.find("big");
+    CHECK(e && (e->flags & TocEntry::Compressed));
+    if (!e) return;
+    CHECK(reader.toc.blockCount(*e) == 5);
+    CHECK(readAll(reader, *e, 4000, 300) == content.substr(4000, 300));
+    CHECK(readAll(reader, *e, 4095, 8194) == content.substr(4095, 8194));
+    CHECK(readAll(reader, *e, 19000, 5000) == content.substr(19000));
+    CHECK(readAll(reader, *e, 20000, 10).empty());
+    auto whole = std::string{};
+    for (size_t offset{0}; offset < content.size(); offset += 1000) {
+        whole += readAll(reader, *e, offset, 1000);
+    }
+    CHECK(whole == content);
+}
+
+/** identical files share their content and know how many entries share it */
+void testDeduplication() {
+    auto dir = TempDir{};
+    writeFile(dir.path / "a", pattern(2000, 1));
+    writeFile(dir.path / "b", pattern(2000, 1));
+    writeFile(dir.path / "c", pattern(2000, 2));
+    {
+        auto writer = Writer{dir.path / "test.gar"};
+        for (auto name : {"a", "b", "c"}) {
+            writer.addPathAs(dir.path / name, name);
+        }
+        writer.close();
+    }
+    auto reader = Reader{dir.path / "test.gar"};
+    auto a = reader.toc.find("a");
+    auto b = reader.toc.find("b");
+    auto c = reader.toc.find("c");
+    CHECK(a && b && c);
+    if (!a || !b || !c) return;
+    CHECK(a->header.type == 0 && b->header.type == 3);
+    CHECK(a->fileOffset == b->fileOffset);
+    CHECK(a->linkCount == 2 && b->linkCount == 2);
+    CHECK(c->linkCount == 1);
+    CHECK(readAll(reader, *b, 0, 2000) == pattern(2000, 1));
+}
+
+/** a modified block is detected when it is read, other blocks stay readable */
+void testCorruptBlock() {
+    auto dir = TempDir{};
+    writeFile(dir.path / "a", pattern(200000, 3));
+    writeFile(dir.path / "b", pattern(200000, 4));
+    {
+        auto writer = Writer{dir.path / "test.gar"};
+        writer.merkleBlockSize = 4096;
+        writer.addPathAs(dir.path / "a", "a");
+        writer.addPathAs(dir.path / "b", "b");
+        writer.close();
+    }
+    auto root = std::optional<Hash>{};
+    {
+        auto reader = Reader{dir.path / "test.gar"};
+        root = reader.merkleRoot();
+        CHECK(root && *root == reader.computeMerkleRoot(1));
+        reader.enableVerification(root);
+        CHECK(readAll(reader, *reader.toc.find("a"), 0, 200000) == pattern(200000, 3));
+
+        auto other = *root;
+        other[0] ^= 1;
+        CHECK_THROWS(Reader{dir.path / "test.gar"}.enableVerification(other));
+
+        // flip a single byte in the middle of "a"
+        auto offset = reader.toc.find("a")->fileOffset + 100000;
+        auto file   = std::fstream{dir.path / "test.gar", std::ios::in | std::ios::out | std::ios::binary};
+        file.seekg(offset);
+        auto c = static_cast<char>(file.get());
+        file.seekp(offset);
+        file.put(static_cast<char>(c ^ 1));
+    }
+    auto reader = Reader{dir.path / "test.gar"};
+    reader.enableVerification(root); // the tree and the table of contents are intact
+    auto a = reader.toc.find("a");
+    CHECK(readAll(reader, *a, 0, 1000) == pattern(1000, 3));
+    CHECK_THROWS(readAll(reader, *a, 99000, 2000));
+    CHECK(readAll(reader, *reader.toc.find("b"), 0, 200000) == pattern(200000, 4));
+}
+}
+
+int main() {
+    testCompressedRead();
+    testDeduplication();
+    testCorruptBlock();
+    return testResult("test-reader");
+}
@@ -0,0 +1,79 @@
+// SPDX-FileCopyrightText: 2023 S. G. Gottlieb <info.simon@gottliebtfreitag.de>
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#include "test.h"
+#include "fsx/Toc.h"
+
+using namespace fsx;
+
+namespace {
+auto header(uint8_t type, uint64_t size = 0) -> EntryHeader {
+    return EntryHeader{.uid = 0, .gid = 0, .type = type, .perms = 0644, .size = size, .name_size = 0};
+}
+
+/** entries are added out of order, lookups must still find them */
+void testSortAndLookup() {
+    auto builder = TocBuilder{};
+    builder.add(header(0, 10), "usr/lib/libz.so", 100);
+    builder.add(header(1), "usr", 0);
+    builder.add(header(0, 10), "usr/bin/ls", 200);
+    builder.add(header(1), "usr/lib", 0);
+    builder.add(header(1), "usr/bin", 0);
+    builder.add(header(0, 10), "usr/bin/cat", 300);
+    builder.add(header(0, 10), "usr-file", 400);
+
+    auto footer = Footer{};
+    auto data   = builder.build(footer);
+    auto toc    = TocView{data, footer};
+    CHECK(toc.entries.size() == 7);
+
+    // sorted by parent directory, then by name
+    for (size_t i{1}; i < toc.entries.size(); ++i) {
+        CHECK(splitName(toc.name(toc.entries[i-1])) < splitName(toc.name(toc.entries[i])));
+    }
+
+    auto ls = toc.find("usr/bin/ls");
+    CHECK(ls && ls->fileOffset == 200);
+    CHECK(toc.find("usr", "/bin", "cat") && toc.find("usr", "/bin", "cat")->fileOffset == 300);
+    CHECK(toc.find("usr-file") && toc.find("usr-file")->fileOffset == 400);
+    CHECK(toc.find("usr/bin/missing") == nullptr);
+    CHECK(toc.find("usr/bi") == nullptr);
+
+    auto bin = toc.find("usr/bin");
+    CHECK(bin && bin->childCount == 2);
+    if (bin) {
+        auto children = toc.children(*bin);
+        CHECK(toc.baseName(children[0]) == "cat");
+        CHECK(toc.baseName(children[1]) == "ls");
+        CHECK(toc.findChild(*bin, "ls") == ls);
+        CHECK(toc.findChild(*bin, "lt") == nullptr);
+    }
+}
+
+/** a compressed entry needs a block size and its blocks inside the block table */
+void testCorruptedBlockTable() {
+    auto builder = TocBuilder{};
+    builder.add(header(0, 100), "a", 0, TocEntry::Compressed, {50});
+    auto footer = Footer{};
+    auto data   = builder.build(footer);
+
+    footer.blockSize = 100;
+    CHECK(TocView(data, footer).blockCount(TocView(data, footer).entries[0]) == 1);
+
+    footer.blockSize = 10; // 10 blocks needed, only 1 stored
+    auto toc = TocView{data, footer};
+    CHECK_THROWS(toc.blockCount(toc.entries[0]));
+
+    footer.blockSize = 0;
+    CHECK_THROWS((TocView{data, footer}));
+    footer.blockCount = 0;
+    auto noBlocks = TocView{data, footer};
+    CHECK_THROWS(noBlocks.blockCount(noBlocks.entries[0]));
+}
+}
+
+int main() {
+    testSortAndLookup();
+    testCorruptedBlockTable();
+    return testResult("test-toc");
+}
@@ -0,0 +1,57 @@
+// SPDX-FileCopyrightText: 2023 S. G. Gottlieb <info.simon@gottliebtfreitag.de>
+// SPDX-License-Identifier: AGPL-3.0-only
+
+#include "test.h"
+#include "UpperLayer.h"
+
+namespace {
+void testWhiteout() {
+    auto dir   = TempDir{};
+    auto upper = UpperLayer{dir.path};
+    std::filesystem::create_directories(dir.path / "usr/lib");
+    CHECK(!upper.hides("/usr/lib/libz.so"));
+
+    CHECK(upper.addWhiteout("/usr/lib/libz.so") == 0);
+    CHECK(upper.hasWhiteout("/usr/lib/libz.so"));
+    CHECK(upper.hides("/usr/lib/libz.so"));
+    CHECK(!upper.hides("/usr/lib/libc.so"));
+    CHECK(!upper.contains("/usr/lib/libz.so"));
+
+    // a deleted directory hides everything below it
+    CHECK(upper.addWhiteout("/usr/share") == 0);
+    CHECK(upper.hides("/usr/share"));
+    CHECK(upper.hides("/usr/share/doc/readme"));
+    CHECK(!upper.hasWhiteout("/usr/share/doc/readme"));
+
+    CHECK(upper.removeWhiteout("/usr/share"));
+    CHECK(!upper.hides("/usr/share/doc/readme"));
+    CHECK(!upper.removeWhiteout("/usr/share"));
+}
+
+void testOpaque() {
+    auto dir   = TempDir{};
+    auto upper = UpperLayer{dir.path};
+    std::filesystem::create_directories(dir.path / "etc/conf");
+    CHECK(upper.setOpaque("/etc") == 0);
+    CHECK(upper.isOpaque("/etc"));
+    CHECK(!upper.isOpaque("/etc/conf"));
+    CHECK(upper.hides("/etc/passwd"));
+    CHECK(upper.hides("/etc/conf/a/b"));
+    CHECK(!upper.hides("/etc"));
+    CHECK(!upper.hides("/usr/bin"));
+
+    CHECK(UpperLayer::isInternal(".wh..wh..opq"));
+    CHECK(UpperLayer::isInternal(".wh.passwd"));
+    CHECK(!UpperLayer::isInternal("passwd"));
+
+    upper.clearInternal("/etc");
+    CHECK(!upper.isOpaque("/etc"));
+    CHECK(!upper.hides("/etc/passwd"));
+}
+}
+
+int main() {
+    testWhiteout();
+    testOpaque();
+    return testResult("test-upper-layer");
+}
@@ -0,0 +1,76 @@
+// SPDX-FileCopyrightText: 2023 S. G. Gottlieb <info.simon@gottliebtfreitag.de>
+// SPDX-License-Identifier: AGPL-3.0-only
+#pragma once
+
+#include <cstdlib>
+#include <exception>
+#include <filesystem>
+#include <fmt/format.h>
+#include <fmt/std.h>
+#include <fstream>
+#include <string>
+
+/**
+ * Minimal helpers for the tests, each tests/test-*.cpp is a program of its own
+ *
+ * A failed CHECK is reported and the test continues, the exit code of the
+ * program tells if any check failed.
+ */
+inline int testFailures{};
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fmt::print(stderr, "{}:{}: check failed: {}\n", __FILE__, __LINE__, #cond); \
+            ++testFailures; \
+        } \
+    } while (0)
+
+#define CHECK_THROWS(expr) \
+    do { \
+        auto thrown = false; \
+        try { \
+            expr; \
+        } catch (std::exception const&) { \
+            thrown = true; \
+        } \
+        if (!thrown) { \
+            fmt::print(stderr, "{}:{}: expected exception: {}\n", __FILE__, __LINE__, #expr); \
+            ++testFailures; \
+        } \
+    } while (0)
+
+/** fresh directory, removed with all its content at the end of the scope
+ */
+struct TempDir {
+    std::filesystem::path path;
+
+    TempDir() {
+        auto pattern = (std::filesystem::temp_directory_path() / "slix-test-XXXXXX").string();
+        if (!::mkdtemp(pattern.data())) {
+            fmt::print(stderr, "failed creating temporary directory\n");
+            std::exit(1);
+        }
+        path = pattern;
+    }
+    TempDir(TempDir const&) = delete;
+    ~TempDir() {
+        auto ec = std::error_code{};
+        std::filesystem::remove_all(path, ec);
+    }
+};
+
+inline void writeFile(std::filesystem::path const& path, std::string const& content) {
+    std::filesystem::create_directories(path.parent_path());
+    auto ofs = std::ofstream{path, std::ios::binary};
+    ofs << content;
+}
+
+inline auto testResult(char const* name) -> int {
+    if (testFailures > 0) {
+        fmt::print(stderr, "{}: {} check(s) failed\n", name, testFailures);
+        return 1;
+    }
+    fmt::print("{}: ok\n", name);
+    return 0;
+}